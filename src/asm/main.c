@@ -0,0 +1,1165 @@
+#include "../cpu/image.h"
+#include "../cpu/insn.h"
+#include <ctype.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//   Assembler
+//
+//   asm [-2] [-o image] source
+//
+//   -2 selects the word aligned v2 encoding (opcode.h), v1 is the default.
+//   One statement per line, `;` or `//` start a comment.
+//
+//       label:
+//       NAME = expr                     constant, same as `.equ NAME, expr`
+//       mov %eax, 0xff0a
+//       mov %eax, %ebx
+//       mov %eax, [%ebx + 12345]
+//       mov [%eax + 12345], %ebx
+//       movl [%eax + 12345], 0xff0a     b, w, l or q gives the store size
+//       push %eax
+//       addsd %xmm0, %xmm1
+//       mov %xmm0, 1.5                  float literals become IEEE doubles
+//       int 0x21
+//
+//   Memory offsets count operands, not bytes: [%ebx + 2] with a dword
+//   operand is 8 bytes past %ebx, as the interpreter scales them.
+//
+//   Directives: .text .data .byte .word .long .quad .float .double .ascii
+//   .asciz .zero .align .equ
+//
+//   Text is loaded at address 0 and data follows it on the next page, at a
+//   multiple of IMAGE_DATA_ALIGN, as the sealed text has its pages to itself.
+//   In v2 text instructions must stay word aligned, and offsets may use
+//   32 bits instead of 16.
+//   Expressions are sums and differences of numbers, characters and
+//   symbols. The source is assembled in a single pass, references that
+//   can not be resolved yet are recorded as fixups and patched at the end.
+//
+
+enum section {
+    TEXT,
+    DATA,
+    ABS,
+};
+
+struct symbol {
+    const char* name;
+    u32         len;
+    u32         hash;
+    bool        defined;
+    u8          section;
+    i64         value;
+};
+
+struct expr {
+    i64    value;
+    int    symbol; // symbol still to be added, or -1
+    bool   is_float;
+    double fvalue;
+};
+
+struct fixup {
+    u8  section;
+    u8  size;
+    u32 offset;
+    int symbol;
+    i64 addend;
+    u32 line;
+};
+
+struct buffer {
+    u8* data;
+    u32 len;
+    u32 cap;
+};
+
+enum operand_kind {
+    OP_REG,
+    OP_MEM,
+    OP_IMM,
+};
+
+struct operand {
+    enum operand_kind kind;
+    int               size; // register size
+    int               reg;  // register, or base register of OP_MEM
+    struct expr       expr; // immediate or memory offset
+};
+
+// Opcodes in table order, the forms of one mnemonic are adjacent
+static const u8 table[] = {
+#define X(OPCODE, ...) OPCODE,
+    OPCODES(X)
+#undef X
+};
+
+// Operands each layout expects
+static const struct {
+    int               n;
+    enum operand_kind kind[3];
+} shapes[] = {
+    [L_RI]   = { 2, { OP_REG, OP_IMM } },
+    [L_RR]   = { 2, { OP_REG, OP_REG } },
+    [L_RM]   = { 2, { OP_REG, OP_MEM } },
+    [L_MI]   = { 2, { OP_MEM, OP_IMM } },
+    [L_MR]   = { 2, { OP_MEM, OP_REG } },
+    [L_R]    = { 1, { OP_REG } },
+    [L_XX]   = { 2, { OP_REG, OP_REG } },
+    [L_XXX]  = { 3, { OP_REG, OP_REG, OP_REG } },
+    [L_XG]   = { 2, { OP_REG, OP_REG } },
+    [L_GX]   = { 2, { OP_REG, OP_REG } },
+    [L_I8]   = { 1, { OP_IMM } },
+    [L_NONE] = { 0 },
+};
+
+static const struct {
+    const char* name;
+    int         size;
+    int         reg;
+} registers[] = {
+    { "al", BYTE, AL },
+    { "ah", BYTE, AH },
+    { "cl", BYTE, CL },
+    { "ch", BYTE, CH },
+    { "dl", BYTE, DL },
+    { "dh", BYTE, DH },
+    { "bl", BYTE, BL },
+    { "bh", BYTE, BH },
+    { "ax", WORD, AX },
+    { "cx", WORD, CX },
+    { "dx", WORD, DX },
+    { "bx", WORD, BX },
+    { "sp", WORD, SP },
+    { "bp", WORD, BP },
+    { "si", WORD, SI },
+    { "di", WORD, DI },
+    { "ip", WORD, IP },
+    { "eax", DWORD, EAX },
+    { "ecx", DWORD, ECX },
+    { "edx", DWORD, EDX },
+    { "ebx", DWORD, EBX },
+    { "esp", DWORD, ESP },
+    { "ebp", DWORD, EBP },
+    { "esi", DWORD, ESI },
+    { "edi", DWORD, EDI },
+    { "eip", DWORD, EIP },
+    { "r9", DWORD, R9 },
+    { "r10", DWORD, R10 },
+    { "r11", DWORD, R11 },
+    { "r12", DWORD, R12 },
+    { "r13", DWORD, R13 },
+    { "r14", DWORD, R14 },
+    { "r15", DWORD, R15 },
+    { "xmm0", QWORD, XMM0 },
+    { "xmm1", QWORD, XMM1 },
+    { "xmm2", QWORD, XMM2 },
+    { "xmm3", QWORD, XMM3 },
+    { "xmm4", QWORD, XMM4 },
+    { "xmm5", QWORD, XMM5 },
+    { "xmm6", QWORD, XMM6 },
+    { "xmm7", QWORD, XMM7 },
+};
+
+#define NOPCODES (sizeof(table) / sizeof(table[0]))
+#define NREGISTERS (sizeof(registers) / sizeof(registers[0]))
+
+static const char* path;
+static u32         line;
+static int         errors;
+static enum isa    isa = ISA_V1;
+static const char* p; // cursor in the current line
+
+static struct buffer sections[2];
+static int           current = TEXT;
+
+// Symbols live in a dense array so their indexes stay valid, the hash
+// table maps names to index + 1
+static struct symbol* symbols;
+static u32            symbols_len;
+static u32            symbols_cap;
+static u32*           slots;
+static u32            slots_cap;
+
+static struct fixup* fixups;
+static u32           fixups_len;
+static u32           fixups_cap;
+
+static u8 mnemonic_slots[64];
+static u8 register_slots[128];
+
+static void error(const char* fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+
+    fprintf(stderr, "%s:%u: ", path, line);
+    vfprintf(stderr, fmt, args);
+    fputc('\n', stderr);
+
+    va_end(args);
+    errors++;
+}
+
+static void* grow(void* ptr, u32* cap, u32 need, size_t elem)
+{
+    if (need <= *cap) {
+        return ptr;
+    }
+
+    u32 n = *cap ? *cap : 256;
+    while (n < need) {
+        n *= 2;
+    }
+
+    if ((ptr = realloc(ptr, (size_t)n * elem)) == NULL) {
+        perror("asm");
+        exit(1);
+    }
+
+    *cap = n;
+    return ptr;
+}
+
+static u32 hash(const char* name, u32 len)
+{
+    u32 h = 2166136261u;
+
+    for (u32 i = 0; i < len; i++) {
+        h = (h ^ (u8)name[i]) * 16777619u;
+    }
+
+    return h;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//   Tables
+//
+
+static void rehash()
+{
+    u32 cap = slots_cap ? slots_cap * 2 : 1024;
+
+    free(slots);
+    if ((slots = calloc(cap, sizeof(*slots))) == NULL) {
+        perror("asm");
+        exit(1);
+    }
+    slots_cap = cap;
+
+    for (u32 i = 0; i < symbols_len; i++) {
+        u32 j = symbols[i].hash & (cap - 1);
+        while (slots[j] != 0) {
+            j = (j + 1) & (cap - 1);
+        }
+        slots[j] = i + 1;
+    }
+}
+
+// Returns the index of the named symbol, adding it undefined if needed
+static int intern(const char* name, u32 len)
+{
+    u32 h = hash(name, len);
+
+    if ((symbols_len + 1) * 2 > slots_cap) {
+        rehash();
+    }
+
+    u32 j = h & (slots_cap - 1);
+    for (; slots[j] != 0; j = (j + 1) & (slots_cap - 1)) {
+        struct symbol* s = &symbols[slots[j] - 1];
+        if (s->hash == h && s->len == len && memcmp(s->name, name, len) == 0) {
+            return slots[j] - 1;
+        }
+    }
+
+    symbols = grow(symbols, &symbols_cap, symbols_len + 1, sizeof(*symbols));
+    symbols[symbols_len] = (struct symbol) { name, len, h, false, ABS, 0 };
+    slots[j]             = symbols_len + 1;
+
+    return symbols_len++;
+}
+
+static int find(const char* name, u32 len, const u8* table, u32 cap,
+    const char* (*name_of)(int))
+{
+    u32 h = hash(name, len);
+
+    for (u32 j = h & (cap - 1); table[j] != 0; j = (j + 1) & (cap - 1)) {
+        const char* candidate = name_of(table[j] - 1);
+        if (strncmp(candidate, name, len) == 0 && candidate[len] == '\0') {
+            return table[j] - 1;
+        }
+    }
+
+    return -1;
+}
+
+static void insert(u8* table, u32 cap, const char* name, int index)
+{
+    u32 j = hash(name, strlen(name)) & (cap - 1);
+
+    while (table[j] != 0) {
+        j = (j + 1) & (cap - 1);
+    }
+    table[j] = index + 1;
+}
+
+static const char* mnemonic_name(int i)
+{
+    return opcodes[table[i]].mnemonic;
+}
+
+static const char* register_name(int i)
+{
+    return registers[i].name;
+}
+
+static void init_tables()
+{
+    for (u32 i = 0; i < NOPCODES; i++) {
+        if (i == 0 || strcmp(mnemonic_name(i), mnemonic_name(i - 1)) != 0) {
+            insert(mnemonic_slots, sizeof(mnemonic_slots), mnemonic_name(i), i);
+        }
+    }
+
+    for (u32 i = 0; i < NREGISTERS; i++) {
+        insert(register_slots, sizeof(register_slots), registers[i].name, i);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//   Output
+//
+
+static struct buffer* out()
+{
+    return &sections[current];
+}
+
+static void emit(const void* bytes, u32 n)
+{
+    struct buffer* b = out();
+
+    b->data = grow(b->data, &b->cap, b->len + n, 1);
+    memcpy(b->data + b->len, bytes, n);
+    b->len += n;
+}
+
+static void emit_u8(u8 byte)
+{
+    emit(&byte, 1);
+}
+
+static bool fits(i64 value, int bytes)
+{
+    if (bytes >= 8) {
+        return true;
+    }
+
+    i64 bound = (i64)1 << (8 * bytes);
+    return value >= -bound / 2 && value < bound;
+}
+
+// Value of an immediate of the given width stored at `offset` in the
+// current section, unresolved symbols are recorded as fixups
+static u64 value_of(struct expr* e, int bytes, u32 offset)
+{
+    if (e->symbol >= 0) {
+        fixups = grow(fixups, &fixups_cap, fixups_len + 1, sizeof(*fixups));
+        fixups[fixups_len++] = (struct fixup) {
+            .section = current,
+            .size    = bytes,
+            .offset  = offset,
+            .symbol  = e->symbol,
+            .addend  = e->value,
+            .line    = line,
+        };
+    } else if (!fits(e->value, bytes)) {
+        error("value %lld does not fit in %d bytes", (long long)e->value, bytes);
+    }
+
+    u64 value = e->value;
+
+    if (e->is_float) {
+        if (bytes == sizeof(float)) {
+            float f = e->fvalue;
+            memcpy(&value, &f, sizeof(f));
+        } else {
+            memcpy(&value, &e->fvalue, sizeof(e->fvalue));
+        }
+    }
+
+    return value;
+}
+
+static void emit_expr(struct expr* e, int bytes)
+{
+    u64 value = value_of(e, bytes, out()->len);
+    emit(&value, bytes); // little-endian host
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//   Lexer
+//
+
+static bool is_ident(char c)
+{
+    return isalnum((u8)c) || c == '_' || c == '.' || c == '$';
+}
+
+static bool at_end()
+{
+    return *p == '\0' || *p == '\n' || *p == ';' || (p[0] == '/' && p[1] == '/');
+}
+
+static void skip_space()
+{
+    while (*p == ' ' || *p == '\t' || *p == '\r') {
+        p++;
+    }
+}
+
+static bool accept(char c)
+{
+    skip_space();
+    if (*p == c) {
+        p++;
+        return true;
+    }
+    return false;
+}
+
+static bool expect(char c)
+{
+    if (!accept(c)) {
+        error("expected '%c'", c);
+        return false;
+    }
+    return true;
+}
+
+static u32 ident(const char** start)
+{
+    skip_space();
+    *start = p;
+    while (is_ident(*p)) {
+        p++;
+    }
+    return p - *start;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//   Expressions
+//
+
+static bool primary(struct expr* e, int sign)
+{
+    skip_space();
+
+    if (*p == '\'') {
+        if (p[1] == '\0' || p[1] == '\n' || p[2] != '\'') {
+            error("unterminated character literal");
+            while (!at_end()) {
+                p++;
+            }
+            return false;
+        }
+        e->value += sign * (u8)p[1];
+        p += 3;
+        return true;
+    }
+
+    if (isdigit((u8)*p)) {
+        const char* start = p;
+        char*       end;
+        bool        hex = p[0] == '0' && (p[1] == 'x' || p[1] == 'X');
+
+        while (is_ident(*p) || ((*p == '+' || *p == '-') && !hex
+                                   && (p[-1] == 'e' || p[-1] == 'E'))) {
+            p++;
+        }
+
+        if (!hex && memchr(start, '.', p - start) != NULL) {
+            e->is_float = true;
+            e->fvalue += sign * strtod(start, &end);
+        } else {
+            e->value += sign * (i64)strtoull(start, &end, 0);
+        }
+
+        if (end != p) {
+            error("malformed number");
+            return false;
+        }
+        return true;
+    }
+
+    const char* name;
+    u32         len = ident(&name);
+
+    if (len == 0) {
+        error("expected expression");
+        return false;
+    }
+
+    int            id = intern(name, len);
+    struct symbol* s  = &symbols[id];
+
+    if (s->defined && (s->section == ABS || s->section == TEXT)) {
+        e->value += sign * s->value;
+    } else if (sign > 0 && e->symbol < 0) {
+        e->symbol = id;
+    } else {
+        error("expression needs a value for %.*s", (int)len, name);
+        return false;
+    }
+
+    return true;
+}
+
+static bool expression(struct expr* e)
+{
+    *e = (struct expr) { .symbol = -1 };
+
+    int sign = accept('-') ? -1 : 1;
+
+    if (!primary(e, sign)) {
+        return false;
+    }
+
+    for (;;) {
+        if (accept('+')) {
+            sign = 1;
+        } else if (accept('-')) {
+            sign = -1;
+        } else {
+            return true;
+        }
+
+        if (!primary(e, sign)) {
+            return false;
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//   Operands
+//
+
+static bool reg(int* size, int* index)
+{
+    const char* name;
+
+    if (!accept('%')) {
+        error("expected register");
+        return false;
+    }
+
+    u32 len = ident(&name);
+    int i   = find(name, len, register_slots, sizeof(register_slots), register_name);
+
+    if (i < 0) {
+        error("unknown register %%%.*s", (int)len, name);
+        return false;
+    }
+
+    *size  = registers[i].size;
+    *index = registers[i].reg;
+    return true;
+}
+
+static bool operand(struct operand* op)
+{
+    skip_space();
+
+    if (*p == '%') {
+        op->kind = OP_REG;
+        return reg(&op->size, &op->reg);
+    }
+
+    if (accept('[')) {
+        op->kind = OP_MEM;
+        op->expr = (struct expr) { .symbol = -1 };
+
+        if (!reg(&op->size, &op->reg)) {
+            return false;
+        }
+
+        if (op->size != DWORD) {
+            error("base register must be a dword register");
+            return false;
+        }
+
+        skip_space();
+        if (*p == '+' || *p == '-') {
+            // a leading minus belongs to the expression
+            if (*p == '+') {
+                p++;
+            }
+
+            if (!expression(&op->expr)) {
+                return false;
+            }
+        }
+
+        return expect(']');
+    }
+
+    op->kind = OP_IMM;
+    return expression(&op->expr);
+}
+
+static int operands(struct operand* ops, int max)
+{
+    int n = 0;
+
+    skip_space();
+    if (at_end()) {
+        return 0;
+    }
+
+    do {
+        if (n == max) {
+            error("too many operands");
+            return -1;
+        }
+
+        if (!operand(&ops[n++])) {
+            return -1;
+        }
+    } while (accept(','));
+
+    return n;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//   Instructions
+//
+
+// Register size an unsized layout wants for operand i
+static int fixed_size(enum layout layout, int i)
+{
+    switch (layout) {
+    case L_XG:
+        return i == 0 ? QWORD : DWORD;
+    case L_GX:
+        return i == 0 ? DWORD : QWORD;
+    default:
+        return QWORD;
+    }
+}
+
+static bool matches(enum layout layout, struct operand* ops, int n)
+{
+    if (n != shapes[layout].n) {
+        return false;
+    }
+
+    for (int i = 0; i < n; i++) {
+        if (ops[i].kind != shapes[layout].kind[i]) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Encodes `op` with operands that match its layout, `size` is the size
+// given by a b, w, l or q suffix, or -1
+static void assemble_insn(u8 op, struct operand* ops, int size)
+{
+    enum layout  layout = opcodes[op].layout;
+    struct insn  insn   = { .op = op };
+    struct expr* imm    = NULL;
+    struct expr* offs   = NULL;
+    int          n      = 0;
+
+    if (!layout_sized(layout) && size >= 0) {
+        error("%s takes no size suffix", opcodes[op].mnemonic);
+        return;
+    }
+
+    for (int i = 0; i < shapes[layout].n; i++) {
+        struct operand* o = &ops[i];
+
+        switch (o->kind) {
+        case OP_REG:
+            if (!layout_sized(layout)) {
+                int want = fixed_size(layout, i);
+
+                if (o->size != want) {
+                    error("expected %s register", want == QWORD ? "an xmm" : "a dword");
+                    return;
+                }
+            } else if (size >= 0 && o->size != size) {
+                error("operand size mismatch");
+                return;
+            } else {
+                size = o->size;
+            }
+            break;
+
+        case OP_MEM:
+            offs = &o->expr;
+            break;
+
+        case OP_IMM:
+            imm = &o->expr;
+            break;
+        }
+
+        insn.reg[n] = o->reg;
+        n += o->kind != OP_IMM;
+    }
+
+    if (layout_sized(layout)) {
+        if (size < 0) {
+            error("operand size needed, use a b, w, l or q suffix");
+            return;
+        }
+        insn.size = size;
+    }
+
+    if (offs != NULL) {
+        if (offs->is_float) {
+            error("offset must be an integer");
+        }
+        insn.offs = value_of(offs, insn_offs_len(isa),
+            out()->len + insn_offs_pos(isa, layout));
+    }
+
+    if (imm != NULL) {
+        int bytes = layout == L_I8 ? 1 : 1 << insn.size;
+
+        if (imm->is_float && insn.size != QWORD) {
+            error("float immediates need an xmm register");
+        }
+        insn.imm = value_of(imm, bytes, out()->len + insn_imm_pos(isa, layout));
+    }
+
+    if (isa == ISA_V2 && out()->len % V2_WORD != 0) {
+        error("instruction not word aligned");
+    }
+
+    u8 code[INSN_MAX];
+    emit(code, encode_insn(isa, code, &insn));
+}
+
+// Picks the form of the mnemonic starting at table[first] that fits the
+// operands
+static void assemble(int first, int size)
+{
+    const char*    mnemonic = mnemonic_name(first);
+    struct operand ops[3];
+    int            n = operands(ops, 3);
+
+    if (n < 0) {
+        return;
+    }
+
+    for (u32 i = first; i < NOPCODES && strcmp(mnemonic_name(i), mnemonic) == 0; i++) {
+        if (matches(opcodes[table[i]].layout, ops, n)) {
+            assemble_insn(table[i], ops, size);
+            return;
+        }
+    }
+
+    error("invalid operands for %s", mnemonic);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//   Directives
+//
+
+static void define(const char* name, u32 len, u8 section, i64 value)
+{
+    int            id = intern(name, len);
+    struct symbol* s  = &symbols[id];
+
+    if (s->defined) {
+        error("%.*s redefined", (int)len, name);
+        return;
+    }
+
+    s->defined = true;
+    s->section = section;
+    s->value   = value;
+}
+
+static void pad(u32 align)
+{
+    u8 fill = current == TEXT ? NOP : 0;
+
+    if (current == TEXT && isa == ISA_V2) {
+        u8  nop[INSN_MAX];
+        u32 n = encode_insn(isa, nop, &(struct insn) { .op = NOP });
+
+        while (out()->len % align != 0 && out()->len % n == 0) {
+            emit(nop, n);
+        }
+    }
+
+    while (out()->len % align != 0) {
+        emit_u8(fill);
+    }
+}
+
+static void data_values(int bytes, bool floats)
+{
+    struct expr e;
+
+    do {
+        if (!expression(&e)) {
+            return;
+        }
+
+        if (floats && !e.is_float) {
+            e.is_float = true;
+            e.fvalue   = e.value;
+        } else if (!floats && e.is_float) {
+            error("expected integer");
+        }
+
+        emit_expr(&e, bytes);
+    } while (accept(','));
+}
+
+static void string(bool terminate)
+{
+    if (!accept('"')) {
+        error("expected string");
+        return;
+    }
+
+    while (*p != '"') {
+        char c = *p++;
+
+        if (c == '\0' || c == '\n') {
+            error("unterminated string");
+            return;
+        }
+
+        if (c == '\\') {
+            switch (c = *p++) {
+            case 'n':
+                c = '\n';
+                break;
+            case 't':
+                c = '\t';
+                break;
+            case '0':
+                c = '\0';
+                break;
+            }
+        }
+
+        emit_u8(c);
+    }
+
+    p++;
+    if (terminate) {
+        emit_u8(0);
+    }
+}
+
+static void directive(const char* name, u32 len)
+{
+#define IS(s) (len == sizeof(s) - 1 && memcmp(name, s, len) == 0)
+
+    struct expr e;
+
+    if (IS(".text")) {
+        current = TEXT;
+    } else if (IS(".data")) {
+        current = DATA;
+    } else if (IS(".byte")) {
+        data_values(sizeof(u8), false);
+    } else if (IS(".word")) {
+        data_values(sizeof(u16), false);
+    } else if (IS(".long")) {
+        data_values(sizeof(u32), false);
+    } else if (IS(".quad")) {
+        data_values(sizeof(u64), false);
+    } else if (IS(".float")) {
+        data_values(sizeof(float), true);
+    } else if (IS(".double")) {
+        data_values(sizeof(double), true);
+    } else if (IS(".ascii")) {
+        string(false);
+    } else if (IS(".asciz")) {
+        string(true);
+    } else if (IS(".zero")) {
+        if (expression(&e) && e.symbol < 0 && e.value >= 0) {
+            while (e.value--) {
+                emit_u8(0);
+            }
+        } else {
+            error(".zero needs a known size");
+        }
+    } else if (IS(".align")) {
+        if (expression(&e) && e.symbol < 0 && e.value > 0 && e.value <= 4096) {
+            pad(e.value);
+        } else {
+            error(".align needs a known alignment");
+        }
+    } else if (IS(".equ")) {
+        const char* sym;
+        u32         n = ident(&sym);
+
+        if (n == 0 || !expect(',') || !expression(&e)) {
+            error("expected .equ name, value");
+        } else if (e.symbol >= 0) {
+            error("constants must be known when defined");
+        } else {
+            define(sym, n, ABS, e.value);
+        }
+    } else {
+        error("unknown directive %.*s", (int)len, name);
+    }
+
+#undef IS
+}
+
+static void statement(const char* text)
+{
+    p = text;
+
+    for (;;) {
+        skip_space();
+        if (at_end()) {
+            return;
+        }
+
+        const char* name;
+        u32         len = ident(&name);
+
+        if (len == 0) {
+            error("unexpected '%c'", *p);
+            return;
+        }
+
+        if (accept(':')) {
+            define(name, len, current, out()->len);
+            continue;
+        }
+
+        if (name[0] == '.') {
+            directive(name, len);
+        } else if (accept('=')) {
+            struct expr e;
+            if (!expression(&e)) {
+                return;
+            }
+            if (e.symbol >= 0) {
+                error("constants must be known when defined");
+                return;
+            }
+            define(name, len, ABS, e.value);
+        } else {
+            static const char suffixes[] = "bwlq";
+
+            const char* suffix = NULL;
+            int m = find(name, len, mnemonic_slots, sizeof(mnemonic_slots), mnemonic_name);
+
+            // movl and friends, the suffix gives the operand size
+            if (m < 0 && (suffix = strchr(suffixes, name[len - 1])) != NULL) {
+                m = find(name, len - 1, mnemonic_slots, sizeof(mnemonic_slots),
+                    mnemonic_name);
+            }
+
+            if (m < 0) {
+                error("unknown instruction %.*s", (int)len, name);
+                return;
+            }
+            assemble(m, suffix ? suffix - suffixes : -1);
+        }
+
+        skip_space();
+        if (!at_end()) {
+            error("junk at end of line");
+        }
+        return;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//   Driver
+//
+
+static u32 data_base()
+{
+    u32 text = sections[TEXT].len;
+    return (text + IMAGE_DATA_ALIGN - 1) / IMAGE_DATA_ALIGN * IMAGE_DATA_ALIGN;
+}
+
+static void resolve()
+{
+    for (u32 i = 0; i < fixups_len; i++) {
+        struct fixup*  f = &fixups[i];
+        struct symbol* s = &symbols[f->symbol];
+
+        line = f->line;
+
+        if (!s->defined) {
+            error("undefined symbol %.*s", (int)s->len, s->name);
+            continue;
+        }
+
+        i64 value = s->value + f->addend;
+        if (s->section == DATA) {
+            value += data_base();
+        }
+
+        if (!fits(value, f->size)) {
+            error("value of %.*s does not fit in %d bytes", (int)s->len, s->name,
+                f->size);
+        }
+
+        memcpy(sections[f->section].data + f->offset, &value, f->size);
+    }
+}
+
+static char* read_file(const char* name, size_t* size)
+{
+    FILE* file = fopen(name, "rb");
+    char* text = NULL;
+
+    if (file == NULL) {
+        perror(name);
+        return NULL;
+    }
+
+    if (fseek(file, 0, SEEK_END) == 0) {
+        long len = ftell(file);
+        rewind(file);
+
+        if (len >= 0 && (text = malloc(len + 1)) != NULL
+            && fread(text, 1, len, file) == (size_t)len) {
+            text[len] = '\0';
+            *size     = len;
+        } else {
+            free(text);
+            text = NULL;
+            perror(name);
+        }
+    }
+
+    fclose(file);
+    return text;
+}
+
+// Written beside the image and renamed over it, a cpu running the old
+// image keeps its pages instead of seeing them truncated and rewritten
+static int write_image(const char* name)
+{
+    char tmp[FILENAME_MAX];
+
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", name) >= (int)sizeof(tmp)) {
+        fprintf(stderr, "%s: name too long\n", name);
+        return -1;
+    }
+
+    FILE* file = fopen(tmp, "wb");
+
+    if (file == NULL) {
+        perror(tmp);
+        return -1;
+    }
+
+    struct image_header hdr = {
+        .magic     = HDR_MAGIC_PAGED,
+        .text_len  = sections[TEXT].len,
+        .total_len = sections[DATA].len ? data_base() + sections[DATA].len
+                                        : sections[TEXT].len,
+        .isa       = isa,
+    };
+
+    static const u8 zeros[IMAGE_TEXT_OFFSET];
+
+    bool ok = fwrite(&hdr, sizeof(hdr), 1, file) == 1
+        && fwrite(zeros, 1, IMAGE_TEXT_OFFSET - sizeof(hdr), file)
+            == IMAGE_TEXT_OFFSET - sizeof(hdr)
+        && fwrite(sections[TEXT].data, 1, sections[TEXT].len, file) == sections[TEXT].len;
+
+    if (ok && sections[DATA].len) {
+        u32 padding = data_base() - sections[TEXT].len;
+
+        ok = fwrite(zeros, 1, padding, file) == padding
+            && fwrite(sections[DATA].data, 1, sections[DATA].len, file)
+                == sections[DATA].len;
+    }
+
+    if (fclose(file) != 0 || !ok || rename(tmp, name) != 0) {
+        perror(name);
+        remove(tmp);
+        return -1;
+    }
+
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    const char* output = "a.img";
+    int         i      = 1;
+
+    for (; i < argc - 1; i++) {
+        if (strcmp(argv[i], "-2") == 0) {
+            isa = ISA_V2;
+        } else if (strcmp(argv[i], "-o") == 0 && i < argc - 2) {
+            output = argv[++i];
+        } else {
+            break;
+        }
+    }
+
+    if (i != argc - 1) {
+        fprintf(stderr, "usage: %s [-2] [-o image] source\n", argv[0]);
+        return 1;
+    }
+
+    size_t size;
+    char*  text = read_file(path = argv[i], &size);
+
+    if (text == NULL) {
+        return 1;
+    }
+
+    init_tables();
+
+    for (char* s = text; s < text + size; s++) {
+        char* eol = memchr(s, '\n', text + size - s);
+
+        if (eol == NULL) {
+            eol = text + size;
+        }
+        *eol = '\0';
+
+        line++;
+        statement(s);
+        s = eol;
+    }
+
+    resolve();
+
+    if (errors != 0) {
+        fprintf(stderr, "%d error%s\n", errors, errors > 1 ? "s" : "");
+        return 1;
+    }
+
+    return write_image(output) != 0;
+}
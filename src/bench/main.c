@@ -0,0 +1,307 @@
+#include "../cpu/cpu.h"
+#include "../cpu/encode.h"
+#include "../cpu/insn.h"
+#include "../cpu/verify.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//   Interpreter benchmarks
+//
+//   Every benchmark assembles a straight-line guest program of about
+//   BENCH_INSNS instructions ending in HALT, runs it once to warm up, then
+//   times `reps` runs of exec(). Each program is built in both encodings,
+//   so the v1 and v2 results differ only in decode cost. Every run is a
+//   child process of its own, starting from the same empty guest memory
+//   and reporting its own peak RSS. Results go to stdout as one JSON
+//   document.
+//
+//   Memory streams walk their working set one cache line (BENCH_STRIDE
+//   bytes) at a time, wrapping around, with %ebx rebased every
+//   BENCH_REBASE accesses so the 16 bit offsets stay in range.
+//
+
+#define BENCH_INSNS (1 << 22)
+#define BENCH_REPS 5
+#define BENCH_STRIDE 64
+#define BENCH_REBASE 256
+#define BENCH_DATA 0x04000000
+
+struct bench {
+    const char* name;
+    int         size;
+    u32         working_set;
+    void (*build)(int size, u32 working_set);
+};
+
+static u8*      ip;
+static u64      insns;
+static enum isa isa;
+
+static u64 now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Register operand for the given size, the n-th register of its class
+static u8 reg(int size, int n)
+{
+    switch (size) {
+    case BYTE:
+        return encode_r8((enum r8[]) { AL, CL, DL, BL }[n % 4]);
+    case WORD:
+        return encode_r16((enum r16[]) { AX, CX, DX, SI }[n % 4]);
+    case DWORD:
+        return encode_r32((enum r32[]) { EAX, ECX, EDX, ESI }[n % 4]);
+    default:
+        return encode_r64(n % 8);
+    }
+}
+
+static void emit(struct insn insn)
+{
+    ip += encode_insn(isa, ip, &insn);
+    insns++;
+}
+
+static void emit_mov_rr(u8 dst, u8 src)
+{
+    emit((struct insn) { .op = MOV_RR, .size = dst & 3, .reg = { dst >> 2, src >> 2 } });
+}
+
+static void emit_mov_rm(u8 dst, u8 base, i16 offs)
+{
+    emit((struct insn) {
+        .op = MOV_RM, .size = dst & 3, .reg = { dst >> 2, base >> 2 }, .offs = offs });
+}
+
+static void emit_mov_mr(u8 base, i16 offs, u8 src)
+{
+    emit((struct insn) {
+        .op = MOV_MR, .size = src & 3, .reg = { base >> 2, src >> 2 }, .offs = offs });
+}
+
+static void emit_base(u32 addr)
+{
+    emit((struct insn) { .op = MOV_RI, .size = DWORD, .reg = { EBX }, .imm = addr });
+}
+
+static void emit_push(u8 reg)
+{
+    emit((struct insn) { .op = PUSH, .size = reg & 3, .reg = { reg >> 2 } });
+}
+
+static void emit_pop(u8 reg)
+{
+    emit((struct insn) { .op = POP, .size = reg & 3, .reg = { reg >> 2 } });
+}
+
+static void build_moves(int size, u32 working_set)
+{
+    (void)working_set;
+
+    for (int i = 0; insns < BENCH_INSNS; i++) {
+        emit_mov_rr(reg(size, i), reg(size, i + 1));
+    }
+}
+
+static void build_stream(int size, u32 working_set, bool store)
+{
+    int bytes = 1 << size;
+    u32 addr  = 0;
+
+    // untouched pages all map to the zero page, loads would never miss
+    memset(&cpu.data[BENCH_DATA], 0xa5, working_set);
+
+    while (insns < BENCH_INSNS) {
+        emit_base(BENCH_DATA + addr);
+
+        for (int i = 0; i < BENCH_REBASE; i++) {
+            i16 offs = i * BENCH_STRIDE / bytes;
+
+            if (store) {
+                emit_mov_mr(encode_r32(EBX), offs, reg(size, i));
+            } else {
+                emit_mov_rm(reg(size, i), encode_r32(EBX), offs);
+            }
+        }
+
+        addr = (addr + BENCH_REBASE * BENCH_STRIDE) % working_set;
+    }
+}
+
+static void build_loads(int size, u32 working_set)
+{
+    build_stream(size, working_set, false);
+}
+
+static void build_stores(int size, u32 working_set)
+{
+    build_stream(size, working_set, true);
+}
+
+// Pushes `working_set` bytes worth of slots, then pops them all back
+static void build_push_pop(int size, u32 working_set)
+{
+    u32 depth = working_set / (size == QWORD ? sizeof(u64) : sizeof(u32));
+
+    while (insns < BENCH_INSNS) {
+        for (u32 i = 0; i < depth; i++) {
+            emit_push(reg(size, i));
+        }
+
+        for (u32 i = 0; i < depth; i++) {
+            emit_pop(reg(size, i));
+        }
+    }
+}
+
+static int by_value(const void* a, const void* b)
+{
+    u64 x = *(const u64*)a;
+    u64 y = *(const u64*)b;
+
+    return (x > y) - (x < y);
+}
+
+static long peak_rss_kb(const struct rusage* usage)
+{
+#ifdef __APPLE__
+    return usage->ru_maxrss / 1024;
+#else
+    return usage->ru_maxrss;
+#endif
+}
+
+// Prints the result up to the peak RSS, which only the parent learns
+static void measure(struct bench* b, int reps)
+{
+    u64                 times[reps];
+    struct verify_error err;
+
+    ip      = cpu.data;
+    insns   = 0;
+    cpu.isa = isa;
+    b->build(b->size, b->working_set);
+    emit((struct insn) { .op = HALT });
+
+    if (verify(ip - cpu.data, &err) != 0) {
+        fprintf(stderr, "%s: text+0x%x: %s\n", b->name, err.offset, err.reason);
+        exit(1);
+    }
+
+    reset();
+    exec();
+
+    for (int i = 0; i < reps; i++) {
+        reset();
+        u64 start = now();
+        exec();
+        times[i] = now() - start;
+    }
+
+    qsort(times, reps, sizeof(u64), by_value);
+
+    double best   = (double)times[0] / insns;
+    double median = (double)times[reps / 2] / insns;
+
+    printf("    { \"name\": \"%s\", \"isa\": \"v%d\", \"size\": \"%s\", \"working_set\": %u, "
+           "\"instructions\": %llu, \"reps\": %d, \"ns_per_insn\": %.3f, "
+           "\"ns_per_insn_median\": %.3f, \"mips\": %.1f, ",
+        b->name, (int)isa, operand_size_str(b->size), b->working_set, (unsigned long long)insns,
+        reps, best, median, 1e3 / best);
+}
+
+// Each benchmark runs in a child of its own: ru_maxrss is a high-water
+// mark, in one process every benchmark after the largest working set
+// would report the same peak
+static void run(struct bench* b, int reps, bool last)
+{
+    struct rusage usage;
+    int           status;
+
+    fflush(stdout);
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        measure(b, reps);
+        exit(0);
+    }
+
+    if (pid < 0 || wait4(pid, &status, 0, &usage) != pid || !WIFEXITED(status)
+        || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "%s: benchmark failed\n", b->name);
+        exit(1);
+    }
+
+    printf("\"peak_rss_kb\": %ld }%s\n", peak_rss_kb(&usage), last ? "" : ",");
+    fflush(stdout);
+}
+
+static struct bench benches[] = {
+    { "mov_rr", BYTE, 0, build_moves },
+    { "mov_rr", WORD, 0, build_moves },
+    { "mov_rr", DWORD, 0, build_moves },
+    { "mov_rr", QWORD, 0, build_moves },
+
+    { "load", BYTE, 1 << 14, build_loads },
+    { "load", WORD, 1 << 14, build_loads },
+    { "load", DWORD, 1 << 14, build_loads },
+    { "load", QWORD, 1 << 14, build_loads },
+    { "load", BYTE, 1 << 20, build_loads },
+    { "load", WORD, 1 << 20, build_loads },
+    { "load", DWORD, 1 << 20, build_loads },
+    { "load", QWORD, 1 << 20, build_loads },
+    { "load", BYTE, 1 << 26, build_loads },
+    { "load", WORD, 1 << 26, build_loads },
+    { "load", DWORD, 1 << 26, build_loads },
+    { "load", QWORD, 1 << 26, build_loads },
+
+    { "store", BYTE, 1 << 14, build_stores },
+    { "store", WORD, 1 << 14, build_stores },
+    { "store", DWORD, 1 << 14, build_stores },
+    { "store", QWORD, 1 << 14, build_stores },
+    { "store", BYTE, 1 << 20, build_stores },
+    { "store", WORD, 1 << 20, build_stores },
+    { "store", DWORD, 1 << 20, build_stores },
+    { "store", QWORD, 1 << 20, build_stores },
+    { "store", BYTE, 1 << 26, build_stores },
+    { "store", WORD, 1 << 26, build_stores },
+    { "store", DWORD, 1 << 26, build_stores },
+    { "store", QWORD, 1 << 26, build_stores },
+
+    { "push_pop", DWORD, 1 << 6, build_push_pop },
+    { "push_pop", QWORD, 1 << 6, build_push_pop },
+    { "push_pop", DWORD, 1 << 20, build_push_pop },
+    { "push_pop", QWORD, 1 << 20, build_push_pop },
+};
+
+int main(int argc, char** argv)
+{
+    int reps = argc > 1 ? atoi(argv[1]) : BENCH_REPS;
+    int n    = sizeof(benches) / sizeof(benches[0]);
+
+    if (reps <= 0) {
+        fprintf(stderr, "usage: %s [reps]\n", argv[0]);
+        return 1;
+    }
+
+    printf("{\n  \"benchmarks\": [\n");
+
+    for (int i = 0; i < n; i++) {
+        for (isa = ISA_V1; isa <= ISA_V2; isa++) {
+            run(&benches[i], reps, isa == ISA_V2 && i == n - 1);
+        }
+    }
+
+    printf("  ]\n}\n");
+    return 0;
+}
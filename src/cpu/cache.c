@@ -0,0 +1,204 @@
+#include "cache.h"
+#include "cpu.h"
+#include "stats.h"
+#include "verify.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __APPLE__
+#include <mach-o/dyld.h>
+#endif
+
+static const char* dir;
+static u64         text_hash;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//   Hashing
+//
+
+static u64 rotl(u64 x, int n)
+{
+    return x << n | x >> (64 - n);
+}
+
+static u64 avalanche(u64 h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    return h ^ h >> 33;
+}
+
+// Eight bytes a step, the text is hashed on every start
+static u64 hash(const void* data, size_t len, u64 seed)
+{
+    const u8* p = data;
+    u64       h = seed ^ len * 0x9e3779b97f4a7c15ull;
+
+    for (; len >= sizeof(u64); p += sizeof(u64), len -= sizeof(u64)) {
+        u64 w;
+        memcpy(&w, p, sizeof(w));
+        h = rotl(h ^ rotl(w * 0x87c37b91114253d5ull, 31) * 0x4cf5ad432745937full, 27) * 5
+            + 0x52dce729;
+    }
+
+    u64 tail = 0;
+    memcpy(&tail, p, len);
+    return avalanche(h ^ tail * 0x87c37b91114253d5ull);
+}
+
+// 0 if the executable can not be found, the cache is not used then
+static u64 build_id()
+{
+    char        path[1024] = "/proc/self/exe";
+    struct stat st;
+
+#ifdef __APPLE__
+    uint32_t size = sizeof(path);
+    if (_NSGetExecutablePath(path, &size) != 0) {
+        return 0;
+    }
+#endif
+
+    if (stat(path, &st) != 0) {
+        return 0;
+    }
+
+    u64 id[] = { st.st_size, st.st_mtime, st.st_ino, CACHE_VERSION };
+    return hash(id, sizeof(id), 0);
+}
+
+static u64 checksum(const struct cache_header* hdr, const u64* map)
+{
+    struct cache_header h = *hdr;
+
+    h.checksum = 0;
+    return hash(map, VERIFY_MAP_WORDS(h.text_len) * sizeof(u64), hash(&h, sizeof(h), 0));
+}
+
+static void entry_path(char* path, size_t size)
+{
+    snprintf(path, size, "%s/%016llx.code", dir, (unsigned long long)text_hash);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//   Entries
+//
+
+void cache_open(const char* path)
+{
+    dir = path;
+}
+
+int cache_load(u32 text_len)
+{
+    if (dir == NULL) {
+        return -1;
+    }
+
+    u64  start = stats_clock();
+    char path[1024];
+
+    text_hash = hash(cpu.data, text_len, cpu.isa);
+    entry_path(path, sizeof(path));
+
+    int fd = build_id() != 0 ? open(path, O_RDONLY) : -1;
+    if (fd < 0) {
+        return -1;
+    }
+
+    struct stat st;
+    size_t      words = VERIFY_MAP_WORDS(text_len);
+    size_t      len   = sizeof(struct cache_header) + words * sizeof(u64) + text_len;
+    void*       map   = MAP_FAILED;
+
+    if (fstat(fd, &st) != 0 || st.st_uid != geteuid() || (st.st_mode & (S_IWGRP | S_IWOTH))) {
+        fprintf(stderr, "cache: %s not trusted, verifying\n", path);
+    } else if ((size_t)st.st_size == len) {
+        map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+
+    if (map == MAP_FAILED) {
+        tracef("cache: %s unusable", path);
+        return -1;
+    }
+
+    const struct cache_header* hdr    = map;
+    const u64*                 starts = (const u64*)(hdr + 1);
+    const u8*                  text   = (const u8*)(starts + words);
+
+    if (hdr->magic != CACHE_MAGIC || hdr->version != CACHE_VERSION || hdr->build_id != build_id()
+        || hdr->text_hash != text_hash || hdr->text_len != text_len || hdr->isa != cpu.isa
+        || hdr->checksum != checksum(hdr, starts) || memcmp(text, cpu.data, text_len) != 0) {
+        tracef("cache: %s is stale", path);
+        munmap(map, len);
+        return -1;
+    }
+
+    // the mapping stays for the whole run, the map is used from it
+    verify_adopt(text_len, starts);
+
+    u64 spent = stats_clock() - start;
+    fprintf(stderr, "cache: %016llx hit, verify skipped, %.3f ms saved\n",
+        (unsigned long long)text_hash,
+        hdr->verify_ns > spent ? (hdr->verify_ns - spent) / 1e6 : 0.0);
+    return 0;
+}
+
+void cache_save(u32 text_len, u64 verify_ns)
+{
+    if (dir == NULL || build_id() == 0) {
+        return;
+    }
+
+    const u64*          map = verify_map();
+    struct cache_header hdr = {
+        .magic     = CACHE_MAGIC,
+        .version   = CACHE_VERSION,
+        .build_id  = build_id(),
+        .text_hash = text_hash,
+        .text_len  = text_len,
+        .isa       = cpu.isa,
+        .verify_ns = verify_ns,
+    };
+
+    hdr.checksum = checksum(&hdr, map);
+
+    char path[1024];
+    char tmp[1024 + 16];
+
+    entry_path(path, sizeof(path));
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+
+    // only the owner may write entries, see cache_load()
+    int   fd   = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    FILE* file = fd >= 0 ? fdopen(fd, "wb") : NULL;
+    if (file == NULL) {
+        tracep();
+        if (fd >= 0) {
+            close(fd);
+        }
+        return;
+    }
+
+    size_t words = VERIFY_MAP_WORDS(text_len);
+    bool   ok    = fwrite(&hdr, sizeof(hdr), 1, file) == 1
+        && fwrite(map, sizeof(u64), words, file) == words
+        && fwrite(cpu.data, 1, text_len, file) == text_len;
+
+    if (fclose(file) != 0 || !ok || rename(tmp, path) != 0) {
+        tracep();
+        unlink(tmp);
+        return;
+    }
+
+    tracef("cache: wrote %s", path);
+}
@@ -0,0 +1,61 @@
+#ifndef CACHE_H_
+#define CACHE_H_
+
+#include "mem.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//   Code cache
+//
+//   CPU_CACHE=<dir> keeps what verify() learned about an image's text, the
+//   map of its instruction starts, in <dir>/<hash>.code where <hash> is a
+//   hash of the text. The next run of the same text maps the entry and
+//   skips the verifier, and says on stderr how much startup time that
+//   saved.
+//
+//   +--------------+
+//   | cache_header |  magic, build ID, text hash and length, isa, the
+//   +--------------+  time verify() took, checksum
+//   |     map      |  VERIFY_MAP_WORDS(text_len) words
+//   +--------------+
+//   |     text     |  text_len bytes, the text that was verified
+//   +--------------+
+//
+//   The build ID identifies the emulator binary by the size, mtime and
+//   inode of its executable, so a rebuilt emulator ignores older entries.
+//   Entries are written to a temporary file and renamed into place, the
+//   checksum covers header and map: a torn, truncated or stale entry is
+//   a miss, never used.
+//
+//   The hash only names the entry. A hit needs the stored text to equal
+//   the loaded one byte for byte, so a collision is a miss, and an entry
+//   is only trusted when it belongs to the user running the cpu and is
+//   writable by no one else, as a planted map would let unverified text
+//   run. Comparing and hashing stream through the text, much cheaper than
+//   decoding it.
+//
+
+#define CACHE_MAGIC 0x65686361634e4f
+#define CACHE_VERSION 2
+
+struct cache_header {
+    u64 magic;
+    u64 version;
+    u64 build_id;
+    u64 text_hash;
+    u64 text_len;
+    u64 isa;
+    u64 verify_ns;
+    u64 checksum; // of header and map, computed with this field 0
+};
+
+void cache_open(const char* dir);
+
+// Takes the verified state of cpu.data[0, text_len) from the cache, -1 on
+// a miss
+int cache_load(u32 text_len);
+
+// Stores the state verify() left, it took verify_ns
+void cache_save(u32 text_len, u64 verify_ns);
+
+#endif /* CACHE_H_ */
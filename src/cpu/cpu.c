@@ -1,6 +1,13 @@
 #include "cpu.h"
+#include "debug.h"
+#include "heap.h"
 #include "opcode.h"
 #include "register.h"
+#include "stats.h"
+#include "verify.h"
+#include <math.h>
+#include <setjmp.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
 
@@ -37,9 +44,9 @@
 #define DF 0x0400
 #define OF 0x0800
 
-#define FLAG(flag) (REG_WORD[FLAGS] & flag)
-#define SET_FLAG(flag) REG_WORD_U[FLAGS] |= flag
-#define UNSET_FLAG(flag) REG_WORD_U[FLAGS] &= ~flag
+#define FLAG(flag) (cpu.flags & (flag))
+#define SET_FLAG(flag) cpu.flags |= (flag)
+#define UNSET_FLAG(flag) cpu.flags &= ~(flag)
 
 #define SIGN_EXTEND(x, w) dword_u(dword(x << (32 - w)) >> (32 - w))
 
@@ -54,6 +61,13 @@ static u64* xmm0 = &REG_QWORD_U[XMM0];
 static u32* eip = &REG_DWORD_U[EIP];
 static u32* esp = &REG_DWORD_U[ESP];
 
+// How a trap leaves the dispatch loop, setjmp() returns 0 on the way in
+#define UNWIND_RESUME 1
+#define UNWIND_STOP 2
+
+static jmp_buf trap_env;
+static bool    executing;
+
 u32 bits(u32 data, u32 start, u32 len)
 {
     return (data >> start) & ((1 << len) - 1);
@@ -100,356 +114,685 @@ static u64 fetch_u64()
     return val;
 }
 
-static void mov_gpr8_imm8(enum r8 reg, u8 imm8)
+// The operand size is a constant wherever these are inlined into a handler,
+// so the switches fold away
+static inline u64 fetch_imm(enum operand_size size)
 {
-    REG_BYTE_U[reg] = imm8;
+    switch (size) {
+    case BYTE:
+        return fetch_u8();
+    case WORD:
+        return fetch_u16();
+    case DWORD:
+        return fetch_u32();
+    default:
+        return fetch_u64();
+    }
 }
 
-static void mov_gpr8(enum r8 dst, enum r8 src)
+// Base register and offset of a memory operand, the offset counts operands
+static inline u32 fetch_addr(enum operand_size size)
 {
-    REG_BYTE_U[dst] = REG_BYTE_U[src];
+    u32 base = REG_DWORD_U[decode_operand(fetch_u8())];
+    i16 offs = (i16)fetch_u16();
+
+    return base + (u32)offs * (1 << size);
 }
 
-static void mov_m8_imm8(u32 addr, u8 imm8)
+// v2 immediates and offsets take whole words
+static inline u64 fetch_imm_v2(enum operand_size size)
 {
-    MEM_BYTE_U[addr] = imm8;
+    return size == QWORD ? fetch_u64() : fetch_u32();
 }
 
-static void mov_m8_gpr8(u32 addr, enum r8 src)
+static inline u32 fetch_addr_v2(enum operand_size size, int base)
 {
-    MEM_BYTE_U[addr] = REG_BYTE_U[src];
+    i32 offs = (i32)fetch_u32();
+
+    return REG_DWORD_U[base] + (u32)offs * (1 << size);
+}
+
+static inline u64 read_reg(enum operand_size size, int reg)
+{
+    switch (size) {
+    case BYTE:
+        return REG_BYTE_U[reg];
+    case WORD:
+        return REG_WORD_U[reg];
+    case DWORD:
+        return REG_DWORD_U[reg];
+    default:
+        return REG_QWORD_U[reg];
+    }
+}
+
+// Writing %eip is how the guest branches, only to an instruction of the
+// verified text
+static void jump(u32 addr)
+{
+    if (!insn_start(addr)) {
+        trapf(TRAP_JUMP, "jump: 0x%08x is not an instruction", addr);
+        return;
+    }
+
+    *eip = addr;
 }
 
-static void mov_gpr8_m8(enum r8 dst, u32 addr)
+static inline void write_reg(enum operand_size size, int reg, u64 val)
 {
-    REG_BYTE_U[dst] = MEM_BYTE_U[addr];
+    switch (size) {
+    case BYTE:
+        REG_BYTE_U[reg] = val;
+        break;
+    case WORD:
+        if (reg == IP) {
+            jump((*eip & 0xffff0000) | (u16)val);
+            break;
+        }
+        REG_WORD_U[reg] = val;
+        break;
+    case DWORD:
+        if (reg == EIP) {
+            jump(val);
+            break;
+        }
+        REG_DWORD_U[reg] = val;
+        break;
+    default:
+        REG_QWORD_U[reg] = val;
+        break;
+    }
 }
 
-static void mov_gpr16_imm16(enum r16 reg, u16 imm16)
+static inline u64 read_mem(enum operand_size size, u32 addr)
 {
-    REG_WORD_U[reg] = imm16;
+    stat_read(1 << size);
+
+    switch (size) {
+    case BYTE:
+        return MEM_BYTE_U[addr];
+    case WORD:
+        return *(u16*)&MEM_BYTE_U[addr];
+    case DWORD:
+        return *(u32*)&MEM_BYTE_U[addr];
+    default:
+        return *(u64*)&MEM_BYTE_U[addr];
+    }
 }
 
-static void mov_gpr16(enum r16 dst, enum r16 src)
+static inline void write_mem(enum operand_size size, u32 addr, u64 val)
 {
-    REG_WORD_U[dst] = REG_WORD_U[src];
+    stat_write(1 << size);
+
+    switch (size) {
+    case BYTE:
+        MEM_BYTE_U[addr] = val;
+        break;
+    case WORD:
+        *(u16*)&MEM_BYTE_U[addr] = val;
+        break;
+    case DWORD:
+        *(u32*)&MEM_BYTE_U[addr] = val;
+        break;
+    default:
+        *(u64*)&MEM_BYTE_U[addr] = val;
+        break;
+    }
+}
+
+static inline void op_mov_ri(enum operand_size size, int dst, u64 imm)
+{
+    write_reg(size, dst, imm);
+}
+
+static inline void op_mov_rr(enum operand_size size, int dst, int src)
+{
+    write_reg(size, dst, read_reg(size, src));
+}
+
+static inline void op_mov_rm(enum operand_size size, int dst, u32 addr)
+{
+    write_reg(size, dst, read_mem(size, addr));
+}
+
+static inline void op_mov_mi(enum operand_size size, u32 addr, u64 imm)
+{
+    write_mem(size, addr, imm);
+}
+
+static inline void op_mov_mr(enum operand_size size, u32 addr, int src)
+{
+    write_mem(size, addr, read_reg(size, src));
+}
+
+// Stack slots are a dword, or a qword for xmm registers
+static inline void op_push(enum operand_size size, int src)
+{
+    enum operand_size slot = size == QWORD ? QWORD : DWORD;
+
+    write_mem(slot, *esp, read_reg(size, src));
+    *esp -= 1 << slot;
+    stat_stack(MEMORY_SIZE - 4 - *esp);
+}
+
+static inline void op_pop(enum operand_size size, int dst)
+{
+    enum operand_size slot = size == QWORD ? QWORD : DWORD;
+
+    *esp += 1 << slot;
+    write_reg(size, dst, read_mem(slot, *esp));
+}
+
+static inline void compare(enum operand_size size, u64 a, u64 b)
+{
+    u64 sign = (u64)1 << ((8 << size) - 1);
+    u64 mask = sign | (sign - 1);
+    u64 res  = (a - b) & mask;
+
+    a &= mask;
+    b &= mask;
+
+    UNSET_FLAG(CF | PF | AF | ZF | SF | OF);
+
+    if (a < b) {
+        SET_FLAG(CF);
+    }
+    if (__builtin_parity(res & 0xff) == 0) {
+        SET_FLAG(PF);
+    }
+    if ((a ^ b ^ res) & 0x10) {
+        SET_FLAG(AF);
+    }
+    if (res == 0) {
+        SET_FLAG(ZF);
+    }
+    if (res & sign) {
+        SET_FLAG(SF);
+    }
+    if ((a ^ b) & (a ^ res) & sign) {
+        SET_FLAG(OF);
+    }
+}
+
+static inline void op_cmp_ri(enum operand_size size, int a, u64 imm)
+{
+    compare(size, read_reg(size, a), imm);
+}
+
+static inline void op_cmp_rr(enum operand_size size, int a, int b)
+{
+    compare(size, read_reg(size, a), read_reg(size, b));
+}
+
+static inline void op_cmp_rm(enum operand_size size, int a, u32 addr)
+{
+    compare(size, read_reg(size, a), read_mem(size, addr));
+}
+
+static inline void op_cmp_mi(enum operand_size size, u32 addr, u64 imm)
+{
+    compare(size, read_mem(size, addr), imm);
+}
+
+static inline void op_cmp_mr(enum operand_size size, u32 addr, int b)
+{
+    compare(size, read_mem(size, addr), read_reg(size, b));
+}
+
+static double xmm_sd(enum r64 reg)
+{
+    double val;
+    memcpy(&val, &REG_QWORD_U[reg], sizeof(val));
+    return val;
+}
+
+static void set_xmm_sd(enum r64 reg, double val)
+{
+    memcpy(&REG_QWORD_U[reg], &val, sizeof(val));
+}
+
+static float xmm_ss(enum r64 reg)
+{
+    float val;
+    memcpy(&val, &REG_QWORD_U[reg], sizeof(val));
+    return val;
+}
+
+static void set_xmm_ss(enum r64 reg, float val)
+{
+    memcpy(&REG_QWORD_U[reg], &val, sizeof(val));
+}
+
+static void set_compare_flags(bool unordered, bool equal, bool less)
+{
+    UNSET_FLAG(ZF | PF | CF);
+
+    if (unordered) {
+        SET_FLAG(ZF | PF | CF);
+    } else if (equal) {
+        SET_FLAG(ZF);
+    } else if (less) {
+        SET_FLAG(CF);
+    }
+}
+
+static i32 truncate_i32(double val)
+{
+    // NaN fails both comparisons
+    if (!(val > -2147483649.0 && val < 2147483648.0)) {
+        return INT32_MIN;
+    }
+
+    return (i32)val;
 }
 
-static void mov_m16_imm16(u32 addr, u16 imm16)
+static void op_addsd(enum r64 dst, enum r64 src)
 {
-    *(u16*)&MEM_BYTE_U[addr] = imm16;
+    set_xmm_sd(dst, xmm_sd(dst) + xmm_sd(src));
 }
 
-static void mov_m16_gpr16(u32 addr, enum r16 src)
+static void op_subsd(enum r64 dst, enum r64 src)
 {
-    *(u16*)&MEM_BYTE_U[addr] = REG_WORD_U[src];
+    set_xmm_sd(dst, xmm_sd(dst) - xmm_sd(src));
 }
 
-static void mov_gpr16_m16(enum r16 dst, u32 addr)
+static void op_mulsd(enum r64 dst, enum r64 src)
 {
-    REG_WORD_U[dst] = *(u16*)&MEM_BYTE_U[addr];
+    set_xmm_sd(dst, xmm_sd(dst) * xmm_sd(src));
 }
 
-static void mov_gpr32_imm32(enum r32 reg, u32 imm32)
+static void op_divsd(enum r64 dst, enum r64 src)
 {
-    REG_DWORD_U[reg] = imm32;
+    set_xmm_sd(dst, xmm_sd(dst) / xmm_sd(src));
 }
 
-static void mov_gpr32(enum r32 dst, enum r32 src)
+// min and max return the source operand when either operand is NaN,
+// which is what minsd/maxsd do and lets the compiler emit them directly
+static void op_minsd(enum r64 dst, enum r64 src)
 {
-    REG_DWORD_U[dst] = REG_DWORD_U[src];
+    double a = xmm_sd(dst), b = xmm_sd(src);
+    set_xmm_sd(dst, a < b ? a : b);
 }
 
-static void mov_m32_imm32(u32 addr, u32 imm32)
+static void op_maxsd(enum r64 dst, enum r64 src)
 {
-    *(u32*)&MEM_BYTE_U[addr] = imm32;
+    double a = xmm_sd(dst), b = xmm_sd(src);
+    set_xmm_sd(dst, a > b ? a : b);
 }
 
-static void mov_m32_gpr32(u32 addr, enum r32 src)
+static void op_sqrtsd(enum r64 dst, enum r64 src)
 {
-    *(u32*)&MEM_BYTE_U[addr] = REG_DWORD_U[src];
+    set_xmm_sd(dst, sqrt(xmm_sd(src)));
 }
 
-static void mov_gpr32_m32(enum r32 dst, u32 addr)
+static void op_fmaddsd(enum r64 dst, enum r64 src0, enum r64 src1)
 {
-    REG_DWORD_U[dst] = *(u32*)&MEM_BYTE_U[addr];
+    set_xmm_sd(dst, fma(xmm_sd(src0), xmm_sd(src1), xmm_sd(dst)));
 }
 
-static void mov_xmm_imm64(enum r64 reg, u64 imm64)
+static void op_comisd(enum r64 a, enum r64 b)
 {
-    REG_QWORD_U[reg] = imm64;
+    double x = xmm_sd(a), y = xmm_sd(b);
+    set_compare_flags(isunordered(x, y), x == y, x < y);
 }
 
-static void mov_xmm(enum r64 dst, enum r64 src)
+static void op_cvtsi2sd(enum r64 dst, enum r32 src)
 {
-    REG_QWORD_U[dst] = REG_QWORD_U[src];
+    set_xmm_sd(dst, (double)(i32)REG_DWORD_U[src]);
 }
 
-static void mov_m64_imm64(u32 addr, u64 imm64)
+static void op_cvttsd2si(enum r32 dst, enum r64 src)
 {
-    *(u64*)&MEM_BYTE_U[addr] = imm64;
+    write_reg(DWORD, dst, (u32)truncate_i32(xmm_sd(src)));
 }
 
-static void mov_m64_xmm(u32 addr, enum r64 src)
+static void op_addss(enum r64 dst, enum r64 src)
 {
-    *(u64*)&MEM_BYTE_U[addr] = REG_QWORD_U[src];
+    set_xmm_ss(dst, xmm_ss(dst) + xmm_ss(src));
 }
 
-static void mov_xmm_m64(enum r64 dst, u32 addr)
+static void op_subss(enum r64 dst, enum r64 src)
 {
-    REG_QWORD_U[dst] = *(u64*)&MEM_BYTE_U[addr];
+    set_xmm_ss(dst, xmm_ss(dst) - xmm_ss(src));
+}
+
+static void op_mulss(enum r64 dst, enum r64 src)
+{
+    set_xmm_ss(dst, xmm_ss(dst) * xmm_ss(src));
+}
+
+static void op_divss(enum r64 dst, enum r64 src)
+{
+    set_xmm_ss(dst, xmm_ss(dst) / xmm_ss(src));
+}
+
+static void op_minss(enum r64 dst, enum r64 src)
+{
+    float a = xmm_ss(dst), b = xmm_ss(src);
+    set_xmm_ss(dst, a < b ? a : b);
+}
+
+static void op_maxss(enum r64 dst, enum r64 src)
+{
+    float a = xmm_ss(dst), b = xmm_ss(src);
+    set_xmm_ss(dst, a > b ? a : b);
+}
+
+static void op_sqrtss(enum r64 dst, enum r64 src)
+{
+    set_xmm_ss(dst, sqrtf(xmm_ss(src)));
+}
+
+static void op_fmaddss(enum r64 dst, enum r64 src0, enum r64 src1)
+{
+    set_xmm_ss(dst, fmaf(xmm_ss(src0), xmm_ss(src1), xmm_ss(dst)));
+}
+
+static void op_comiss(enum r64 a, enum r64 b)
+{
+    float x = xmm_ss(a), y = xmm_ss(b);
+    set_compare_flags(isunordered(x, y), x == y, x < y);
+}
+
+static void op_cvtsi2ss(enum r64 dst, enum r32 src)
+{
+    set_xmm_ss(dst, (float)(i32)REG_DWORD_U[src]);
+}
+
+static void op_cvttss2si(enum r32 dst, enum r64 src)
+{
+    write_reg(DWORD, dst, (u32)truncate_i32(xmm_ss(src)));
+}
+
+static void op_cvtsd2ss(enum r64 dst, enum r64 src)
+{
+    set_xmm_ss(dst, (float)xmm_sd(src));
+}
+
+static void op_cvtss2sd(enum r64 dst, enum r64 src)
+{
+    set_xmm_sd(dst, (double)xmm_ss(src));
+}
+
+static void set_trap_handler(u32 addr)
+{
+    if (addr != 0 && (addr >= cpu.text_len || !insn_start(addr))) {
+        trapf(TRAP_INTERRUPT, "trap: handler 0x%08x is not an instruction", addr);
+        return;
+    }
+
+    cpu.trap_handler = addr;
 }
 
 static void interupt(i8 icode)
 {
-    (void)icode;
+    switch ((u8)icode) {
+    case INT_HEAP:
+        heap_service();
+        break;
+
+    case INT_TRAP:
+        set_trap_handler(REG_DWORD_U[EAX]);
+        break;
+
+    default:
+        trapf(TRAP_INTERRUPT, "unhandled interrupt 0x%02x", (u8)icode);
+        break;
+    }
 }
 
-void exec()
+static void op_int(u8 imm8)
 {
-    (void)interupt;
+    trace_event(EV_INTERRUPT, imm8, REG_DWORD_U[EAX]);
+    interupt((i8)imm8);
+}
 
-    *eip = 0x00;
-    REG_DWORD_U[ESP] = MEMORY_SIZE - 4;
+static void op_nop()
+{
+}
+
+static void op_halt()
+{
+    trace_event(EV_HALT, 0, 0);
+    clean();
+}
 
-    int operand_size;
-    int tmp, r0, r1;
-    u8  imm8, op;
-    i16 offs;
-    u16 imm16;
-    u32 imm32, addr;
-    u64 imm64;
+// Only ever found where the debugger patched it in
+static void op_brk()
+{
+    debug_trap();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//   Dispatch
+//
+//   The loops switch on the opcode and the operand size bits together,
+//   and OPCODES expands into one case per opcode and operand size. Each
+//   case decodes the operands of its layout and calls op_<name>() with a
+//   constant size, so once inlined every handler is straight-line code.
+//   Unsized layouts ignore the size bits and get the same handler under
+//   all four cases.
+//
+//   V1_<layout> and V2_<layout> decode a layout in either encoding, in v1
+//   the size bits come from the byte after the opcode, in v2 from the
+//   instruction word `w` that also holds the registers.
+//
+
+#define V1_RI(S)                      \
+    r0  = decode_operand(fetch_u8()); \
+    imm = fetch_imm(S)
+#define V1_RR(S)                     \
+    r0 = decode_operand(fetch_u8()); \
+    r1 = decode_operand(fetch_u8())
+#define V1_RM(S)                       \
+    r0   = decode_operand(fetch_u8()); \
+    addr = fetch_addr(S)
+#define V1_MI(S)          \
+    addr = fetch_addr(S); \
+    imm  = fetch_imm(S)
+#define V1_MR(S)          \
+    addr = fetch_addr(S); \
+    r1   = decode_operand(fetch_u8())
+#define V1_R(S) r0 = decode_operand(fetch_u8())
+#define V1_XX(S) V1_RR(S)
+#define V1_XXX(S) \
+    V1_RR(S);     \
+    r2 = decode_operand(fetch_u8())
+#define V1_XG(S) V1_RR(S)
+#define V1_GX(S) V1_RR(S)
+#define V1_I8(S) imm = fetch_u8()
+#define V1_NONE(S) (void)0
+
+#define V2_RI(S)        \
+    r0  = V2_REG(w, 0); \
+    imm = fetch_imm_v2(S)
+#define V2_RR(S)       \
+    r0 = V2_REG(w, 0); \
+    r1 = V2_REG(w, 1)
+#define V2_RM(S)         \
+    r0   = V2_REG(w, 0); \
+    addr = fetch_addr_v2(S, V2_REG(w, 1))
+#define V2_MI(S)                           \
+    addr = fetch_addr_v2(S, V2_REG(w, 0)); \
+    imm  = fetch_imm_v2(S)
+#define V2_MR(S)                           \
+    addr = fetch_addr_v2(S, V2_REG(w, 0)); \
+    r1   = V2_REG(w, 1)
+#define V2_R(S) r0 = V2_REG(w, 0)
+#define V2_XX(S) V2_RR(S)
+#define V2_XXX(S) \
+    V2_RR(S);     \
+    r2 = V2_REG(w, 2)
+#define V2_XG(S) V2_RR(S)
+#define V2_GX(S) V2_RR(S)
+#define V2_I8(S) imm = (u8)fetch_u32()
+#define V2_NONE(S) (void)0
+
+#define ARGS_RI r0, imm
+#define ARGS_RR r0, r1
+#define ARGS_RM r0, addr
+#define ARGS_MI addr, imm
+#define ARGS_MR addr, r1
+#define ARGS_R r0
+#define ARGS_XX r0, r1
+#define ARGS_XXX r0, r1, r2
+#define ARGS_XG r0, r1
+#define ARGS_GX r0, r1
+#define ARGS_I8 imm
+#define ARGS_NONE
+
+#define SIZED_CASE(ENC, OPCODE, name, layout, S) \
+    case OPCODE << 2 | S:                        \
+        stat_size(OPCODE, S);                    \
+        ENC##_##layout(S);                       \
+        op_##name(S, ARGS_##layout);             \
+        goto next;
+
+#define SIZED_CASES(ENC, OPCODE, name, layout)   \
+    SIZED_CASE(ENC, OPCODE, name, layout, BYTE)  \
+    SIZED_CASE(ENC, OPCODE, name, layout, WORD)  \
+    SIZED_CASE(ENC, OPCODE, name, layout, DWORD) \
+    SIZED_CASE(ENC, OPCODE, name, layout, QWORD)
+
+// HALT is the one handler that leaves the loop, the test is constant
+#define UNSIZED_CASES(ENC, OPCODE, name, layout) \
+    case OPCODE << 2 | BYTE:                     \
+    case OPCODE << 2 | WORD:                     \
+    case OPCODE << 2 | DWORD:                    \
+    case OPCODE << 2 | QWORD:                    \
+        ENC##_##layout(QWORD);                   \
+        op_##name(ARGS_##layout);                \
+        if (OPCODE == HALT) {                    \
+            break;                               \
+        }                                        \
+        goto next;
+
+#define CASES_RI SIZED_CASES
+#define CASES_RR SIZED_CASES
+#define CASES_RM SIZED_CASES
+#define CASES_MI SIZED_CASES
+#define CASES_MR SIZED_CASES
+#define CASES_R SIZED_CASES
+#define CASES_XX UNSIZED_CASES
+#define CASES_XXX UNSIZED_CASES
+#define CASES_XG UNSIZED_CASES
+#define CASES_GX UNSIZED_CASES
+#define CASES_I8 UNSIZED_CASES
+#define CASES_NONE UNSIZED_CASES
+
+#define HANDLER_V1(OPCODE, value, name, mnemonic, layout) \
+    CASES_##layout(V1, OPCODE, name, layout)
+#define HANDLER_V2(OPCODE, value, name, mnemonic, layout) \
+    CASES_##layout(V2, OPCODE, name, layout)
+
+static void exec_v1()
+{
+    int r0, r1, r2;
+    u8  op;
+    u32 addr;
+    u64 imm;
 
 next:
     op = fetch_u8();
-    switch (op) {
-    case MOV_RI:
-        tmp = fetch_u8();
-        switch (operand_size = decode_operand_size(tmp)) {
-        case BYTE:
-            imm8 = fetch_u8();
-            r0 = decode_operand(tmp);
-            mov_gpr8_imm8(r0, imm8);
-            goto next;
-
-        case WORD:
-            imm16 = fetch_u16();
-            r0 = decode_operand(tmp);
-            mov_gpr16_imm16(r0, imm16);
-            goto next;
-
-        case DWORD:
-            imm32 = fetch_u32();
-            r0 = decode_operand(tmp);
-            mov_gpr32_imm32(r0, imm32);
-            goto next;
-
-        case QWORD:
-            imm64 = fetch_u64();
-            r0 = decode_operand(tmp);
-            mov_xmm_imm64(r0, imm64);
-            goto next;
-        }
+    trace_event(EV_INSN, op, 0);
+    stat_op(op);
+    switch (op << 2 | decode_operand_size(MEM_BYTE_U[*eip])) {
+        OPCODES(HANDLER_V1)
+    }
+}
 
-    case MOV_RR:
-        tmp = fetch_u8();
-        r0 = decode_operand(tmp);
-        switch (operand_size = decode_operand_size(tmp)) {
-        case BYTE:
-            tmp = fetch_u8();
-            r1 = decode_operand(tmp);
-            mov_gpr8(r0, r1);
-            goto next;
-
-        case WORD:
-            tmp = fetch_u8();
-            r1 = decode_operand(tmp);
-            mov_gpr16(r0, r1);
-            goto next;
-
-        case DWORD:
-            tmp = fetch_u8();
-            r1 = decode_operand(tmp);
-            mov_gpr32(r0, r1);
-            goto next;
-
-        case QWORD:
-            tmp = fetch_u8();
-            r1 = decode_operand(tmp);
-            mov_xmm(r0, r1);
-            goto next;
-        }
+static void exec_v2()
+{
+    int r0, r1, r2;
+    u32 w, addr;
+    u64 imm;
 
-    case MOV_RM:
-        tmp = fetch_u8();
-        r0 = decode_operand(tmp);
-        switch (operand_size = decode_operand_size(tmp)) {
-        case BYTE:
-            tmp = fetch_u8();
-            r1 = decode_operand(tmp);
-            offs = (i16)fetch_u16();
-            addr = REG_DWORD_U[r1] + sizeof(u8) * offs;
-            mov_gpr8_m8(r0, addr);
-            goto next;
-
-        case WORD:
-            tmp = fetch_u8();
-            r1 = decode_operand(tmp);
-            offs = (i16)fetch_u16();
-            addr = REG_DWORD_U[r1] + sizeof(u16) * offs;
-            mov_gpr16_m16(r0, addr);
-            goto next;
-
-        case DWORD:
-            tmp = fetch_u8();
-            r1 = decode_operand(tmp);
-            offs = (i16)fetch_u16();
-            addr = REG_DWORD_U[r1] + sizeof(u32) * offs;
-            mov_gpr32_m32(r0, addr);
-            goto next;
-
-        case QWORD:
-            tmp = fetch_u8();
-            r1 = decode_operand(tmp);
-            offs = (i16)fetch_u16();
-            addr = REG_DWORD_U[r1] + sizeof(u64) * offs;
-            mov_xmm_m64(r0, addr);
-            goto next;
-        }
+next:
+    w = fetch_u32();
+    trace_event(EV_INSN, V2_OP(w), 0);
+    stat_op(V2_OP(w));
+    switch (w & V2_KEY) {
+        OPCODES(HANDLER_V2)
+    }
+}
 
-    case MOV_MI:
-        tmp = fetch_u8();
-        r0 = decode_operand(tmp);
-        switch (operand_size = decode_operand_size(tmp)) {
-        case BYTE:
-            offs = (i16)fetch_u16();
-            addr = REG_DWORD_U[r0] + sizeof(u8) * offs;
-            imm8 = fetch_u8();
-            mov_m8_imm8(addr, imm8);
-            goto next;
-
-        case WORD:
-            offs = (i16)fetch_u16();
-            addr = REG_DWORD_U[r0] + sizeof(u16) * offs;
-            imm16 = fetch_u16();
-            mov_m16_imm16(addr, r0);
-            goto next;
-
-        case DWORD:
-            offs = (i16)fetch_u16();
-            addr = REG_DWORD_U[r0] + sizeof(u32) * offs;
-            imm32 = fetch_u32();
-            mov_m32_imm32(addr, imm32);
-            goto next;
-
-        case QWORD:
-            offs = (i16)fetch_u16();
-            addr = REG_DWORD_U[r0] + sizeof(u64) * offs;
-            imm64 = fetch_u64();
-            mov_m64_imm64(addr, imm64);
-            goto next;
-        }
+void reset()
+{
+    *eip             = 0x00;
+    REG_DWORD_U[ESP] = MEMORY_SIZE - 4;
+    cpu.trap         = (struct trap){ TRAP_NONE, 0 };
+    cpu.trap_handler = 0;
+}
 
-    case MOV_MR:
-        tmp = fetch_u8();
-        r0 = decode_operand(tmp);
-        switch (operand_size = decode_operand_size(tmp)) {
-        case BYTE:
-            offs = (i16)fetch_u16();
-            addr = REG_DWORD_U[r0] + sizeof(u8) * offs;
-            tmp = fetch_u8();
-            r1 = decode_operand(tmp);
-            mov_m8_gpr8(addr, r1);
-            goto next;
-
-        case WORD:
-            offs = (i16)fetch_u16();
-            addr = REG_DWORD_U[r0] + sizeof(u16) * offs;
-            tmp = fetch_u8();
-            r1 = decode_operand(tmp);
-            mov_m16_gpr16(addr, r1);
-            goto next;
-
-        case DWORD:
-            offs = (i16)fetch_u16();
-            addr = REG_DWORD_U[r0] + sizeof(u32) * offs;
-            tmp = fetch_u8();
-            r1 = decode_operand(tmp);
-            mov_m32_gpr32(addr, r1);
-            goto next;
-
-        case QWORD:
-            offs = (i16)fetch_u16();
-            addr = REG_DWORD_U[r0] + sizeof(u64) * offs;
-            tmp = fetch_u8();
-            r1 = decode_operand(tmp);
-            mov_m64_xmm(addr, r1);
-            goto next;
-        }
+// Start of the instruction being executed, its handler has moved %eip
+// past it
+static u32 current_insn()
+{
+    u32 addr = *eip - 1;
 
-    case PUSH:
-        tmp = fetch_u8();
-        r0 = decode_operand(tmp);
-        switch (operand_size = decode_operand_size(tmp)) {
-        case BYTE:
-            imm32 = REG_BYTE_U[r0];
-            *(u32*)&MEM_BYTE_U[*esp] = imm32;
-            *esp -= sizeof(u32);
-            goto next;
-
-        case WORD:
-            imm32 = REG_WORD_U[r0];
-            *(u32*)&MEM_BYTE_U[*esp] = imm32;
-            *esp -= sizeof(u32);
-            goto next;
-
-        case DWORD:
-            imm32 = REG_DWORD_U[r0];
-            *(u32*)&MEM_BYTE_U[*esp] = imm32;
-            *esp -= sizeof(u32);
-            goto next;
-
-        case QWORD:
-            imm64 = REG_QWORD_U[r0];
-            *(u64*)&MEM_BYTE_U[*esp] = imm64;
-            *esp -= sizeof(u64);
-            goto next;
-        }
-        goto next;
+    while (addr > 0 && !insn_start(addr)) {
+        addr--;
+    }
 
-    case POP:
-        tmp = fetch_u8();
-        r0 = decode_operand(tmp);
-        switch (operand_size = decode_operand_size(tmp)) {
-        case BYTE:
-            *esp += sizeof(u32);
-            REG_BYTE_U[r0] = *(u8*)&MEM_BYTE_U[*esp];
-            goto next;
-
-        case WORD:
-            *esp += sizeof(u32);
-            REG_WORD_U[r0] = *(u16*)&MEM_BYTE_U[*esp];
-            goto next;
-
-        case DWORD:
-            *esp += sizeof(u32);
-            REG_DWORD_U[r0] = *(u32*)&MEM_BYTE_U[*esp];
-            goto next;
-
-        case QWORD:
-            *esp += sizeof(u64);
-            REG_QWORD_U[r0] = *(u64*)&MEM_BYTE_U[*esp];
-            goto next;
-        }
-        goto next;
+    return addr;
+}
 
-    case NOP:
-        goto next;
+static void push_u32(u32 val)
+{
+    write_mem(DWORD, *esp, val);
+    *esp -= sizeof(u32);
+}
 
-    case HALT:
-        clean();
-        break;
+void trapf(enum trap_code code, const char* fmt, ...)
+{
+    cpu.trap = (struct trap){ code, executing ? current_insn() : *eip };
+    trace_event(EV_TRAP, code, cpu.trap.eip);
+
+    if (executing && cpu.trap_handler != 0) {
+        *eip             = cpu.trap_handler;
+        cpu.trap_handler = 0;
+        push_u32(cpu.trap.eip);
+        push_u32(code);
+        longjmp(trap_env, UNWIND_RESUME);
     }
+
+    char    message[TRACE_MESSAGE_MAX];
+    va_list args;
+
+    va_start(args, fmt);
+    vsnprintf(message, sizeof(message), fmt, args);
+    va_end(args);
+    exception(message);
+
+    if (executing) {
+        longjmp(trap_env, UNWIND_STOP);
+    }
+}
+
+void exec()
+{
+    // the one check exec() makes, the loops below trust the text
+    if (cpu.text_len == 0) {
+        exception("exec: text not verified");
+        return;
+    }
+
+    trace_event(EV_EXEC, 0, 0);
+    stat_exec_begin();
+    executing = true;
+
+    // traps come back here, the loop starts over at a guest handler
+    if (setjmp(trap_env) != UNWIND_STOP) {
+        if (cpu.isa == ISA_V2) {
+            exec_v2();
+        } else {
+            exec_v1();
+        }
+    }
+
+    executing = false;
+    stat_exec_end();
 }
 
 void clean()
@@ -2,35 +2,85 @@
 #define CPU_H_
 
 #include "mem.h"
-#include <errno.h>
+#include "opcode.h"
+#include "trace.h"
 #include <string.h>
 
 #define TEXT_SIZE (1 << 16)
 #define MEMORY_SIZE (u32)((u64)(1 << 31) - 1)
+#define MEMORY_PAGE_SIZE (1 << 14)
+
+#define HEAP_BASE 0x10000000
+#define HEAP_SIZE 0x10000000
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//   Traps
+//
+//   A fault found by a handler, an unknown interrupt or a bad heap call,
+//   raises a trap with trapf(). The dispatch loop is left with a longjmp
+//   back into exec(), so handlers need no error returns and the loop no
+//   checks. The trap and the start of the faulting instruction are kept
+//   in cpu.trap.
+//
+//   Unhandled, a trap is reported like an exception and exec() returns.
+//   Guest code can take traps itself by putting a handler address in %eax
+//   and calling `int 0x22`, 0 removes the handler:
+//
+//   +-------------+--------------------------------+
+//   | %esp + 8    | faulting %eip                  |
+//   | %esp + 4    | trap code                      |
+//   +-------------+--------------------------------+
+//
+//   The handler is entered with the two pushed as above and is removed
+//   first, so a fault inside it stops the guest. It registers itself
+//   again to take the next one.
+//
+
+#define INT_TRAP 0x22
+
+enum trap_code {
+    TRAP_NONE,
+    TRAP_INTERRUPT, // int with no service behind it, or a bad handler
+    TRAP_HEAP,      // invalid heap service call
+    TRAP_BRK,       // brk with no debugger attached
+    TRAP_JUMP,      // %eip written with an address that is no instruction
+};
+
+struct trap {
+    u32 code;
+    u32 eip; // start of the faulting instruction
+};
 
 struct cpu {
-    int trap;
-    u8  data[MEMORY_SIZE];
+    struct trap trap;
+    // page aligned so guest pages can be handed to madvise and friends
+    _Alignas(MEMORY_PAGE_SIZE) u8 data[MEMORY_SIZE];
     u32 gpr[16];
     u64 xmm[8];
+    u32 flags;
+    // encoding of the loaded text
+    enum isa isa;
+    // length of the text verify() accepted, 0 if none
+    u32 text_len;
+    // guest trap handler registered with INT_TRAP, 0 if none
+    u32 trap_handler;
 };
 
 extern struct cpu cpu;
 
-#define trace(message) __trace(__func__, message)
-void __trace(const char* func, const char* message);
-
-#define tracef(fmt, ...) __tracef(__func__, fmt, __VA_ARGS__)
-#define tracep() __trace(__func__, strerror(errno))
-void __tracef(const char* func, const char* fmt, ...);
-
-void exception(const char* message);
-void exceptionf(const char* fmt, ...);
-
 int load(char* path);
 
+// Puts %eip at the start of the text and %esp at the top of memory
+void reset();
+
+// Runs the text from %eip until HALT, the text must have passed verify()
 void exec();
 
 void clean();
 
+// Raises a trap from a handler and does not return while exec() runs,
+// outside of it the trap is only reported
+void trapf(enum trap_code code, const char* fmt, ...);
+
 #endif /* CPU_H_ */
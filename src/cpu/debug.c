@@ -0,0 +1,669 @@
+#include "debug.h"
+#include "cpu.h"
+#include "insn.h"
+#include "register.h"
+#include "verify.h"
+#include "watch.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define REG_FLAGS 16
+#define REG_XMM0 17
+#define REG_COUNT 25
+
+struct patch {
+    u32 addr;
+    u8  saved[V2_WORD];
+};
+
+static int  sock = -1;
+static char packet[DEBUG_PACKET];
+
+static u32 breakpoints[DEBUG_BREAKPOINTS];
+static int breakpoints_len;
+
+// a step patches the next instruction and the trap handler as well
+static struct patch patches[DEBUG_BREAKPOINTS + 2];
+static int          patches_len;
+
+// continuing from a breakpoint steps over it first, invisibly to gdb
+static bool stepping_over;
+
+// gdb waits for a stop reply to c and s, not at the first stop
+static bool resumed;
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//   Text
+//
+
+static int brk_len()
+{
+    return cpu.isa == ISA_V2 ? V2_WORD : 1;
+}
+
+static void patch(u32 addr)
+{
+    struct patch* p = &patches[patches_len++];
+    u8            code[INSN_MAX];
+
+    p->addr = addr;
+    memcpy(p->saved, &cpu.data[addr], brk_len());
+    encode_insn(cpu.isa, code, &(struct insn) { .op = BRK });
+
+    seal_text(false);
+    memcpy(&cpu.data[addr], code, brk_len());
+    seal_text(true);
+}
+
+// In reverse, so an address patched twice gets its original back
+static void unpatch()
+{
+    if (patches_len == 0) {
+        return;
+    }
+
+    seal_text(false);
+    while (patches_len > 0) {
+        struct patch* p = &patches[--patches_len];
+        memcpy(&cpu.data[p->addr], p->saved, brk_len());
+    }
+    seal_text(true);
+}
+
+// Puts the original text back over the patches in buf, a copy of len
+// bytes of guest memory from addr. Reads nothing but static state, dumps
+// call it from signal handlers.
+void debug_unpatched(u32 addr, u8* buf, u32 len)
+{
+    for (int i = patches_len - 1; i >= 0; i--) {
+        const struct patch* p = &patches[i];
+
+        for (int j = 0; j < brk_len(); j++) {
+            if (p->addr + j >= addr && p->addr + j < addr + len) {
+                buf[p->addr + j - addr] = p->saved[j];
+            }
+        }
+    }
+}
+
+// Decodes the instruction at addr if one starts there
+static bool insn_at(u32 addr, struct insn* insn)
+{
+    return insn_start(addr) && decode_insn(cpu.isa, &cpu.data[addr], cpu.text_len - addr, insn) > 0;
+}
+
+static int find_breakpoint(u32 addr)
+{
+    for (int i = 0; i < breakpoints_len; i++) {
+        if (breakpoints[i] == addr) {
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+static void resume(bool step)
+{
+    u32         pc = cpu.gpr[EIP];
+    struct insn insn;
+
+    resumed       = true;
+    stepping_over = !step && find_breakpoint(pc) >= 0;
+
+    // nothing follows a HALT, stepping it ends the run
+    if ((step || stepping_over) && insn_at(pc, &insn) && insn.op != HALT) {
+        patch(pc + insn.len);
+    }
+
+    // an instruction that traps goes on in the guest's handler instead
+    if ((step || stepping_over) && cpu.trap_handler != 0 && cpu.trap_handler != pc) {
+        patch(cpu.trap_handler);
+    }
+
+    if (step) {
+        return;
+    }
+
+    for (int i = 0; i < breakpoints_len; i++) {
+        if (breakpoints[i] != pc) {
+            patch(breakpoints[i]);
+        }
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//   Packets
+//
+
+static int get_char()
+{
+    u8 c;
+    return read(sock, &c, 1) == 1 ? c : -1;
+}
+
+static int hex_digit(int c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    } else if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    } else if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+
+    return -1;
+}
+
+// Reads the next packet into `packet` and acknowledges it, -1 once gdb
+// is gone
+static int get_packet()
+{
+    for (;;) {
+        int c;
+
+        while ((c = get_char()) != '$') {
+            if (c < 0) {
+                return -1;
+            }
+        }
+
+        int len = 0;
+        u8  sum = 0;
+
+        while ((c = get_char()) != '#') {
+            if (c < 0) {
+                return -1;
+            }
+            if (len < DEBUG_PACKET - 1) {
+                packet[len++] = c;
+            }
+            sum += c;
+        }
+        packet[len] = '\0';
+
+        int hi = hex_digit(get_char());
+        int lo = hex_digit(get_char());
+
+        if (hi >= 0 && lo >= 0 && (hi << 4 | lo) == sum) {
+            return write(sock, "+", 1) == 1 ? len : -1;
+        }
+        if (write(sock, "-", 1) != 1) {
+            return -1;
+        }
+    }
+}
+
+static void put_packet(const char* data)
+{
+    static char out[DEBUG_PACKET + 4];
+
+    u8  sum = 0;
+    int len = 0;
+
+    out[len++] = '$';
+    for (const char* c = data; *c != '\0' && len < DEBUG_PACKET; c++) {
+        out[len++] = *c;
+        sum += *c;
+    }
+    len += snprintf(out + len, sizeof(out) - len, "#%02x", sum);
+
+    if (write(sock, out, len) != len) {
+        tracep();
+    }
+}
+
+static char* put_hex(char* out, const void* src, u32 len)
+{
+    for (u32 i = 0; i < len; i++) {
+        out += sprintf(out, "%02x", ((const u8*)src)[i]);
+    }
+
+    return out;
+}
+
+static bool get_hex(void* dst, const char* src, u32 len)
+{
+    for (u32 i = 0; i < len; i++) {
+        int hi = hex_digit(src[2 * i]);
+        int lo = hi >= 0 ? hex_digit(src[2 * i + 1]) : -1;
+
+        if (lo < 0) {
+            return false;
+        }
+        ((u8*)dst)[i] = hi << 4 | lo;
+    }
+
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//   Commands
+//
+
+static void* reg_ptr(u32 n, u32* size)
+{
+    if (n < REG_FLAGS) {
+        *size = sizeof(cpu.gpr[n]);
+        return &cpu.gpr[n];
+    } else if (n == REG_FLAGS) {
+        *size = sizeof(cpu.flags);
+        return &cpu.flags;
+    } else if (n < REG_COUNT) {
+        *size = sizeof(cpu.xmm[n - REG_XMM0]);
+        return &cpu.xmm[n - REG_XMM0];
+    }
+
+    return NULL;
+}
+
+// gdb has no architecture for the cpu, the register layout of g packets
+// goes to it as a target description instead
+static const char* target_xml()
+{
+    static char xml[2048];
+
+    if (xml[0] != '\0') {
+        return xml;
+    }
+
+    int len = snprintf(xml, sizeof(xml),
+        "<?xml version=\"1.0\"?>"
+        "<!DOCTYPE target SYSTEM \"gdb-target.dtd\">"
+        "<target version=\"1.0\"><feature name=\"cpu.core\">");
+
+    for (u32 n = 0; n < REG_FLAGS; n++) {
+        len += snprintf(xml + len, sizeof(xml) - len,
+            "<reg name=\"%s\" bitsize=\"32\" type=\"%s\" regnum=\"%u\"/>", r32_str(n),
+            n == EIP ? "code_ptr" : n == ESP ? "data_ptr" : "uint32", n);
+    }
+    len += snprintf(xml + len, sizeof(xml) - len,
+        "<reg name=\"flags\" bitsize=\"32\" type=\"uint32\" regnum=\"%u\"/>", REG_FLAGS);
+    for (u32 n = REG_XMM0; n < REG_COUNT; n++) {
+        len += snprintf(xml + len, sizeof(xml) - len,
+            "<reg name=\"%s\" bitsize=\"64\" type=\"uint64\" regnum=\"%u\"/>",
+            r64_str(n - REG_XMM0), n);
+    }
+    snprintf(xml + len, sizeof(xml) - len, "</feature></target>");
+
+    return xml;
+}
+
+// qXfer:features:read:target.xml:<offset>,<length>, answered with a chunk
+// starting with m while more follows and l for the last one
+static void read_features(char* reply, u32 size)
+{
+    static const char annex[] = "qXfer:features:read:target.xml:";
+
+    const char* xml   = target_xml();
+    u32         total = strlen(xml);
+    char*       end;
+
+    if (strncmp(packet, annex, sizeof(annex) - 1) != 0) {
+        strcpy(reply, "E00");
+        return;
+    }
+
+    u32 offset = strtoul(packet + sizeof(annex) - 1, &end, 16);
+    u32 len    = *end == ',' ? strtoul(end + 1, NULL, 16) : 0;
+
+    if (offset > total) {
+        strcpy(reply, "E01");
+        return;
+    }
+
+    len = len < size - 2 ? len : size - 2;
+    len = len < total - offset ? len : total - offset;
+
+    reply[0] = offset + len < total ? 'm' : 'l';
+    memcpy(reply + 1, xml + offset, len);
+    reply[len + 1] = '\0';
+}
+
+static bool eip_valid()
+{
+    struct insn insn;
+    return insn_at(cpu.gpr[EIP], &insn);
+}
+
+static void read_regs(char* out)
+{
+    for (u32 n = 0; n < REG_COUNT; n++) {
+        u32   size;
+        void* reg = reg_ptr(n, &size);
+        out       = put_hex(out, reg, size);
+    }
+}
+
+static bool write_regs(const char* in)
+{
+    u32 gpr[16];
+    u32 flags = cpu.flags;
+    u64 xmm[8];
+
+    memcpy(gpr, cpu.gpr, sizeof(gpr));
+    memcpy(xmm, cpu.xmm, sizeof(xmm));
+
+    for (u32 n = 0; n < REG_COUNT; n++) {
+        u32   size;
+        void* reg = reg_ptr(n, &size);
+
+        if (!get_hex(reg, in, size)) {
+            break;
+        }
+        in += 2 * size;
+    }
+
+    if (eip_valid()) {
+        return true;
+    }
+
+    memcpy(cpu.gpr, gpr, sizeof(gpr));
+    memcpy(cpu.xmm, xmm, sizeof(xmm));
+    cpu.flags = flags;
+    return false;
+}
+
+static bool write_reg(u32 n, const char* in)
+{
+    u32   size;
+    void* reg = reg_ptr(n, &size);
+    u64   old;
+
+    if (reg == NULL) {
+        return false;
+    }
+
+    memcpy(&old, reg, size);
+    if (get_hex(reg, in, size) && (n != EIP || eip_valid())) {
+        return true;
+    }
+
+    memcpy(reg, &old, size);
+    return false;
+}
+
+static bool mem_range(u32 addr, u32 len)
+{
+    return addr < MEMORY_SIZE && len <= MEMORY_SIZE - addr;
+}
+
+// What points into the text has to keep pointing at instructions once it
+// changes, resume() patches breakpoints and exec() starts at %eip
+static bool text_refs_valid()
+{
+    if (!eip_valid() || (cpu.trap_handler != 0 && !insn_start(cpu.trap_handler))) {
+        return false;
+    }
+
+    for (int i = 0; i < breakpoints_len; i++) {
+        if (!insn_start(breakpoints[i])) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// Text written by gdb must verify like loaded text and leave %eip, the
+// trap handler and the breakpoints on instructions, or it is put back
+static bool write_mem(u32 addr, u32 len, const char* in)
+{
+    static u8 old[DEBUG_PACKET / 2];
+
+    u32                 text_len = cpu.text_len;
+    struct verify_error err;
+
+    if (!mem_range(addr, len) || len > sizeof(old)) {
+        return false;
+    }
+
+    memcpy(old, &cpu.data[addr], len);
+    seal_text(false);
+
+    if (!get_hex(&cpu.data[addr], in, len)) {
+        memcpy(&cpu.data[addr], old, len);
+        seal_text(true);
+        return false;
+    }
+
+    if (addr >= text_len) {
+        seal_text(true);
+        return true;
+    }
+
+    if (verify(text_len, &err) == 0 && text_refs_valid()) {
+        return true;
+    }
+
+    // the old text verified before, this puts its map back
+    seal_text(false);
+    memcpy(&cpu.data[addr], old, len);
+    verify(text_len, &err);
+    return false;
+}
+
+static bool set_breakpoint(u32 addr)
+{
+    struct insn insn;
+
+    if (find_breakpoint(addr) >= 0) {
+        return true;
+    }
+    if (breakpoints_len == DEBUG_BREAKPOINTS || !insn_at(addr, &insn)) {
+        return false;
+    }
+
+    breakpoints[breakpoints_len++] = addr;
+    return true;
+}
+
+static void clear_breakpoint(u32 addr)
+{
+    int i = find_breakpoint(addr);
+
+    if (i >= 0) {
+        breakpoints[i] = breakpoints[--breakpoints_len];
+    }
+}
+
+static void detach()
+{
+    tracef("gdb detached at 0x%08x", cpu.gpr[EIP]);
+    close(sock);
+    sock            = -1;
+    breakpoints_len = 0;
+}
+
+// Answers gdb until it resumes the guest
+static void serve()
+{
+    static char reply[DEBUG_PACKET];
+
+    while (get_packet() >= 0) {
+        char*       end;
+        u32         addr = strtoul(packet + 1, &end, 16);
+        u32         len  = *end == ',' ? strtoul(end + 1, &end, 16) : 0;
+        const char* data = *end == ':' || *end == '=' ? end + 1 : end;
+        bool        ok;
+
+        reply[0] = '\0';
+
+        switch (packet[0]) {
+        case '?':
+            strcpy(reply, "S05");
+            break;
+        case 'g':
+            read_regs(reply);
+            break;
+        case 'G':
+            strcpy(reply, write_regs(packet + 1) ? "OK" : "E01");
+            break;
+        case 'p': {
+            u32   size;
+            void* reg = reg_ptr(addr, &size);
+
+            if (reg != NULL) {
+                put_hex(reply, reg, size);
+            } else {
+                strcpy(reply, "E01");
+            }
+            break;
+        }
+        case 'P':
+            strcpy(reply, write_reg(addr, data) ? "OK" : "E01");
+            break;
+        case 'm':
+            if (mem_range(addr, len) && len <= (DEBUG_PACKET - 1) / 2) {
+                put_hex(reply, &cpu.data[addr], len);
+            } else {
+                strcpy(reply, "E01");
+            }
+            break;
+        case 'M':
+            strcpy(reply, write_mem(addr, len, data) ? "OK" : "E01");
+            break;
+        case 'Z':
+        case 'z':
+            // software breakpoints only, the address follows the type
+            if (packet[1] != '0') {
+                break;
+            }
+            addr = strtoul(packet + 3, NULL, 16);
+            ok   = true;
+            if (packet[0] == 'Z') {
+                ok = set_breakpoint(addr);
+            } else {
+                clear_breakpoint(addr);
+            }
+            strcpy(reply, ok ? "OK" : "E01");
+            break;
+        case 'c':
+        case 's':
+            if (end != packet + 1) {
+                u32 eip       = cpu.gpr[EIP];
+                cpu.gpr[EIP] = addr;
+                if (!eip_valid()) {
+                    cpu.gpr[EIP] = eip;
+                    put_packet("E01");
+                    continue;
+                }
+            }
+            resume(packet[0] == 's');
+            return;
+        case 'D':
+            put_packet("OK");
+            detach();
+            return;
+        case 'k':
+            detach();
+            exit(0);
+        case 'q':
+            if (strncmp(packet, "qSupported", 10) == 0) {
+                snprintf(reply, sizeof(reply), "PacketSize=%x;qXfer:features:read+",
+                    DEBUG_PACKET);
+            } else if (strncmp(packet, "qXfer:features:read:", 20) == 0) {
+                read_features(reply, sizeof(reply));
+            } else if (strcmp(packet, "qAttached") == 0) {
+                strcpy(reply, "1");
+            }
+            break;
+        }
+
+        put_packet(reply);
+    }
+
+    detach();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//   Entry points
+//
+
+int debug_start(const char* port)
+{
+    if (port == NULL) {
+        return 0;
+    }
+
+    struct sockaddr_in addr = {
+        .sin_family      = AF_INET,
+        .sin_port        = htons(strtoul(port, NULL, 10)),
+        .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    int one      = 1;
+
+    if (listener < 0
+        || setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0
+        || bind(listener, (struct sockaddr*)&addr, sizeof(addr)) != 0
+        || listen(listener, 1) != 0) {
+        perror("gdb");
+        if (listener >= 0) {
+            close(listener);
+        }
+        return -1;
+    }
+
+    fprintf(stderr, "waiting for gdb on 127.0.0.1:%s\n", port);
+    sock = accept(listener, NULL, NULL);
+    close(listener);
+
+    if (sock < 0) {
+        perror("gdb");
+        return -1;
+    }
+
+    tracef("gdb attached on port %s", port);
+
+    // stop before the first instruction exec() runs
+    patch(cpu.gpr[EIP]);
+    return 0;
+}
+
+void debug_stop()
+{
+    if (sock < 0) {
+        return;
+    }
+
+    unpatch();
+    if (resumed) {
+        put_packet("W00");
+    }
+    detach();
+}
+
+void debug_trap()
+{
+    if (sock < 0) {
+        trapf(TRAP_BRK, "brk without a debugger");
+        return;
+    }
+
+    unpatch();
+    cpu.gpr[EIP] -= brk_len();
+
+    if (stepping_over && find_breakpoint(cpu.gpr[EIP]) < 0) {
+        resume(false);
+        return;
+    }
+
+    if (resumed) {
+        put_packet("S05");
+    }
+
+    watch_disarm();
+    serve();
+    watch_arm();
+}
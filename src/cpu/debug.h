@@ -0,0 +1,53 @@
+#ifndef DEBUG_H_
+#define DEBUG_H_
+
+#include "mem.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//   Debugger stub
+//
+//   CPU_GDB=<port> makes the cpu wait for a gdb remote serial protocol
+//   connection on 127.0.0.1:<port> before running, and stop before the
+//   first instruction.
+//
+//   Breakpoints and single steps patch BRK over the first byte, or word in
+//   v2, of a guest instruction, exec() runs no code of its own for them:
+//   without a debugger the dispatch loops are the same. Text has no
+//   branches, so a step is a temporary breakpoint on the next instruction.
+//   Patches are only in place while the guest runs, memory reads from gdb
+//   always see the original text.
+//
+//   Supported packets: ? g G p P m M c s Z0 z0 D k qSupported qAttached
+//   qXfer:features:read. Registers, numbered as in g and p packets and
+//   described to gdb by the target.xml it reads with qXfer:
+//
+//   +-------+--------------------------------+------+
+//   |   n   | register                       | bits |
+//   +-------+--------------------------------+------+
+//   |  0-15 | eax ... edi, eip, r9 ... r15   |  32  |
+//   |   16  | flags                          |  32  |
+//   | 17-24 | xmm0 ... xmm7                  |  64  |
+//   +-------+--------------------------------+------+
+//
+//   Writes to the text are verified again and refused if the result does
+//   not verify or leaves %eip, the trap handler or a breakpoint off an
+//   instruction boundary, %eip can only be moved to one either. A
+//   running guest can not be interrupted, gdb gets control back at
+//   breakpoints, after steps and when the guest halts.
+//
+
+#define DEBUG_BREAKPOINTS 64
+#define DEBUG_PACKET 4096
+
+// Waits for gdb when port is set, -1 if no connection could be made
+int  debug_start(const char* port);
+void debug_stop();
+
+// Called by the BRK handler with %eip past the BRK
+void debug_trap();
+
+// Undoes the patches in buf, len bytes of guest memory from addr
+void debug_unpatched(u32 addr, u8* buf, u32 len);
+
+#endif /* DEBUG_H_ */
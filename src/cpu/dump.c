@@ -0,0 +1,245 @@
+#include "dump.h"
+#include "cpu.h"
+#include "debug.h"
+#include "heap.h"
+#include "register.h"
+#include "watch.h"
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define DUMP_PAGES ((MEMORY_SIZE + DUMP_PAGE - 1) / DUMP_PAGE)
+
+static const int signals[] = { SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT };
+
+static const char* path;
+static bool        written;
+static long        host_page;
+static int         fd = -1;
+
+// one entry per host page, which is never smaller than DUMP_PAGE
+static u8  resident[DUMP_PAGES];
+static u32 page_numbers[DUMP_PAGES];
+static u8  text_page[DUMP_PAGE];
+
+static const char* signal_name(int sig)
+{
+    switch (sig) {
+    case SIGSEGV:
+        return "host signal SIGSEGV";
+    case SIGBUS:
+        return "host signal SIGBUS";
+    case SIGFPE:
+        return "host signal SIGFPE";
+    case SIGILL:
+        return "host signal SIGILL";
+    case SIGABRT:
+        return "host signal SIGABRT";
+    }
+
+    return "host signal";
+}
+
+static u32 page_len(u32 page)
+{
+    u32 offset = page * DUMP_PAGE;
+    return MEMORY_SIZE - offset < DUMP_PAGE ? MEMORY_SIZE - offset : DUMP_PAGE;
+}
+
+// Word at a time, which the compiler vectorises
+static bool zero_page(u32 page)
+{
+    const u8* p   = &cpu.data[page * DUMP_PAGE];
+    u32       len = page_len(page);
+    u64       acc = 0;
+    u32       i   = 0;
+
+    for (; i + sizeof(u64) <= len; i += sizeof(u64)) {
+        u64 w;
+        memcpy(&w, p + i, sizeof(w));
+        acc |= w;
+    }
+    for (; i < len; i++) {
+        acc |= p[i];
+    }
+
+    return acc == 0;
+}
+
+static bool write_all(int fd, const void* buf, size_t len)
+{
+    const u8* p = buf;
+
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n <= 0) {
+            return false;
+        }
+        p += n;
+        len -= n;
+    }
+
+    return true;
+}
+
+static bool write_heap(const void* buf, size_t len)
+{
+    return write_all(fd, buf, len);
+}
+
+static void note(const char* text)
+{
+    write_all(STDERR_FILENO, text, strlen(text));
+}
+
+// Safe to call from a signal handler
+static void write_dump(int sig, const char* reason)
+{
+    if (path == NULL || written) {
+        return;
+    }
+    written = true;
+
+    // watched pages may be unreadable
+    watch_disarm();
+
+    struct dump_header hdr = {
+        .magic        = DUMP_MAGIC,
+        .version      = DUMP_VERSION,
+        .flags        = cpu.flags,
+        .isa          = cpu.isa,
+        .text_len     = cpu.text_len,
+        .signal       = sig,
+        .trap_handler = cpu.trap_handler,
+    };
+
+    memcpy(hdr.gpr, cpu.gpr, sizeof(hdr.gpr));
+    memcpy(hdr.xmm, cpu.xmm, sizeof(hdr.xmm));
+    for (int i = 0; i < DUMP_REASON - 1 && reason[i] != '\0'; i++) {
+        hdr.reason[i] = reason[i];
+    }
+
+    // without mincore every page is looked at, untouched ones read as zeros
+    if (mincore(cpu.data, MEMORY_SIZE, (void*)resident) != 0) {
+        memset(resident, 1, sizeof(resident));
+    }
+
+    for (u32 page = 0; page < DUMP_PAGES; page++) {
+        if ((resident[(u64)page * DUMP_PAGE / host_page] & 1) && !zero_page(page)) {
+            page_numbers[hdr.pages++] = page;
+        }
+    }
+
+    static const u8 zeros[DUMP_PAGE];
+
+    fd      = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    bool ok = fd >= 0 && write_all(fd, &hdr, sizeof(hdr))
+        && write_all(fd, page_numbers, hdr.pages * sizeof(u32));
+
+    for (u32 i = 0; ok && i < hdr.pages; i++) {
+        u32       addr = page_numbers[i] * DUMP_PAGE;
+        u32       len  = page_len(page_numbers[i]);
+        const u8* data = &cpu.data[addr];
+
+        // the dumped text is the verified one, without gdb's breakpoints
+        if (addr < cpu.text_len) {
+            memcpy(text_page, data, len);
+            debug_unpatched(addr, text_page, len);
+            data = text_page;
+        }
+
+        ok = write_all(fd, data, len) && write_all(fd, zeros, DUMP_PAGE - len);
+    }
+
+    ok = ok && heap_dump(write_heap);
+
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    note(ok ? "dump: wrote " : "dump: could not write ");
+    note(path);
+    note("\n");
+}
+
+// A fault comes back when the handler returns, a signal sent with kill()
+// does not and is raised again, the default action being restored
+static void on_signal(int sig)
+{
+    write_dump(sig, signal_name(sig));
+    raise(sig);
+}
+
+int dump_start(const char* dump_path)
+{
+    if (dump_path == NULL) {
+        return 0;
+    }
+
+    path      = dump_path;
+    host_page = sysconf(_SC_PAGESIZE);
+
+    // the default action follows once the handler returns, see on_signal()
+    struct sigaction sa = { .sa_handler = on_signal, .sa_flags = SA_RESETHAND };
+    sigemptyset(&sa.sa_mask);
+
+    for (size_t i = 0; i < sizeof(signals) / sizeof(signals[0]); i++) {
+        if (sigaction(signals[i], &sa, NULL) != 0) {
+            tracep();
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+void dump_trap(const char* reason)
+{
+    write_dump(0, reason);
+}
+
+int dump_load(FILE* file, u32* text_len)
+{
+    struct dump_header hdr = { .magic = DUMP_MAGIC };
+    static u8          page[DUMP_PAGE];
+
+    // the magic has been read already
+    if (fread((u8*)&hdr + sizeof(hdr.magic), sizeof(hdr) - sizeof(hdr.magic), 1, file) != 1
+        || hdr.version != DUMP_VERSION || hdr.pages > DUMP_PAGES
+        || (hdr.isa != ISA_V1 && hdr.isa != ISA_V2) || hdr.text_len > HEAP_BASE
+        || fread(page_numbers, sizeof(u32), hdr.pages, file) != hdr.pages) {
+        return -1;
+    }
+
+    if (hdr.signal != 0) {
+        return -2;
+    }
+
+    for (u32 i = 0; i < hdr.pages; i++) {
+        u32 n = page_numbers[i];
+
+        if ((i > 0 && n <= page_numbers[i - 1]) || n >= DUMP_PAGES
+            || fread(page, DUMP_PAGE, 1, file) != 1) {
+            return -1;
+        }
+
+        memcpy(&cpu.data[n * DUMP_PAGE], page, page_len(n));
+    }
+
+    if (heap_undump(file) != 0) {
+        return -1;
+    }
+
+    memcpy(cpu.gpr, hdr.gpr, sizeof(cpu.gpr));
+    memcpy(cpu.xmm, hdr.xmm, sizeof(cpu.xmm));
+    cpu.flags        = hdr.flags;
+    cpu.isa          = hdr.isa;
+    cpu.trap_handler = hdr.trap_handler;
+    *text_len        = hdr.text_len;
+
+    hdr.reason[DUMP_REASON - 1] = '\0';
+    tracef("dump of %s, %llu pages", hdr.reason, (unsigned long long)hdr.pages);
+    return 0;
+}
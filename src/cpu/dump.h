@@ -0,0 +1,69 @@
+#ifndef DUMP_H_
+#define DUMP_H_
+
+#include "mem.h"
+#include <stdio.h>
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//   Crash dumps
+//
+//   CPU_DUMP=<path> writes a dump of the guest to <path> at its first
+//   exception, or when the host process dies of SIGSEGV, SIGBUS, SIGFPE,
+//   SIGILL or SIGABRT. Guest memory is mostly untouched, so only pages
+//   that are resident (mincore) and not all zeros are kept:
+//
+//   +-------------+
+//   | dump_header |  registers, isa and text length, what happened
+//   +-------------+
+//   |    index    |  `pages` u32 page numbers, ascending
+//   +-------------+
+//   |    pages    |  DUMP_PAGE bytes each, in index order, the last
+//   +-------------+  guest page padded with a zero byte
+//   |    heap     |  the allocator state, see heap_dump()
+//   +-------------+
+//
+//   Pages missing from the index are zeros. `crashdump` prints a dump,
+//   and the cpu loads one like an image: memory, registers, the trap
+//   handler and the heap are put back and the guest resumes where it
+//   stopped, CPU_GDB being the way to look around first. Only dumps of
+//   guest exceptions resume: a host signal stops the guest anywhere in a
+//   handler, maybe with %eip already at the next instruction, and
+//   resuming would skip or repeat part of one. A dump whose %eip is not
+//   an instruction of its verified text is refused as well.
+//
+//   Text is dumped as verified, breakpoints gdb has patched in are left
+//   out.
+//
+//   The dump is written from the signal handler for host signals, with
+//   nothing but write(2) on static buffers.
+//
+
+#define DUMP_MAGIC 0x706d7564794e4f
+#define DUMP_VERSION 2
+#define DUMP_PAGE 4096
+#define DUMP_REASON 128
+
+struct dump_header {
+    u64  magic;
+    u64  version;
+    u64  pages;
+    u64  xmm[8];
+    u32  gpr[16];
+    u32  flags;
+    u32  isa;
+    u32  text_len;
+    i32  signal; // host signal, 0 for a guest exception
+    u32  trap_handler;
+    char reason[DUMP_REASON];
+};
+
+int  dump_start(const char* path);
+void dump_trap(const char* reason);
+
+// Restores memory, registers and heap from a dump whose magic has been
+// read from file, -1 if it is corrupted and -2 if it was taken by a host
+// signal. The text still has to be verified and %eip checked against it.
+int dump_load(FILE* file, u32* text_len);
+
+#endif /* DUMP_H_ */
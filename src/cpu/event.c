@@ -0,0 +1,29 @@
+#include "trace.h"
+
+char* trace_event_str(enum trace_event event)
+{
+    switch (event) {
+    case EV_MESSAGE:
+        return "message";
+    case EV_EXCEPTION:
+        return "exception";
+    case EV_EXEC:
+        return "exec";
+    case EV_HALT:
+        return "halt";
+    case EV_INSN:
+        return "insn";
+    case EV_INTERRUPT:
+        return "interrupt";
+    case EV_HEAP_ALLOC:
+        return "heap_alloc";
+    case EV_HEAP_FREE:
+        return "heap_free";
+    case EV_TRAP:
+        return "trap";
+    case EV_WATCH:
+        return "watch";
+    }
+
+    return "unknown";
+}
@@ -0,0 +1,487 @@
+#include "heap.h"
+#include "cpu.h"
+#include "register.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define HEAP_PAGES (HEAP_SIZE / MEMORY_PAGE_SIZE)
+#define HEAP_CLASSES 9 // 16, 32, ..., 4096
+#define SLAB_WORDS (MEMORY_PAGE_SIZE / HEAP_MIN_SMALL / 64)
+
+enum page_kind {
+    PAGE_FREE,
+    PAGE_SLAB,
+    PAGE_LARGE,
+};
+
+// Links are page indexes plus one so that zero means "none" and the whole
+// heap starts out valid as zero initialised memory
+struct page {
+    u8  kind;
+    u8  class;
+    u16 nfree;
+    u32 npages;
+    u32 next;
+    u32 prev;
+    u64 used[SLAB_WORDS];
+};
+
+static struct {
+    struct page       pages[HEAP_PAGES];
+    u64               page_used[HEAP_PAGES / 64];
+    u32               partial[HEAP_CLASSES];
+    u32               hint;
+    struct heap_stats stats;
+} heap;
+
+static u32 class_size(int class)
+{
+    return HEAP_MIN_SMALL << class;
+}
+
+static int size_class(u32 size)
+{
+    int class = 0;
+
+    while (class_size(class) < size) {
+        class++;
+    }
+
+    return class;
+}
+
+static u32 slab_capacity(int class)
+{
+    return MEMORY_PAGE_SIZE / class_size(class);
+}
+
+static u32 page_addr(u32 page)
+{
+    return HEAP_BASE + page * MEMORY_PAGE_SIZE;
+}
+
+static bool page_is_used(u32 page)
+{
+    return heap.page_used[page / 64] & (1ull << (page % 64));
+}
+
+static void mark_pages(u32 page, u32 n, bool used)
+{
+    for (u32 i = page; i < page + n; i++) {
+        if (used) {
+            heap.page_used[i / 64] |= 1ull << (i % 64);
+        } else {
+            heap.page_used[i / 64] &= ~(1ull << (i % 64));
+        }
+    }
+}
+
+// first fit, starting from the lowest page that may be free
+static int alloc_pages(u32 n)
+{
+    u32 run = 0;
+
+    for (u32 page = heap.hint; page < HEAP_PAGES; page++) {
+        if (run == 0 && page % 64 == 0 && heap.page_used[page / 64] == ~0ull) {
+            page += 63;
+            continue;
+        }
+
+        if (page_is_used(page)) {
+            run = 0;
+            continue;
+        }
+
+        if (++run == n) {
+            u32 first = page + 1 - n;
+            mark_pages(first, n, true);
+            if (first == heap.hint) {
+                heap.hint = first + n;
+            }
+            heap.stats.committed_bytes += (u64)n * MEMORY_PAGE_SIZE;
+            return first;
+        }
+    }
+
+    return -1;
+}
+
+// Hands the host pages fully covered by the run back to the kernel. Guest
+// pages are at least as large as host pages on the hosts we target, but
+// round inwards anyway so a larger host page is never partially discarded.
+static void release_pages(u32 page, u32 n)
+{
+    static long host_page;
+
+    if (host_page == 0) {
+        host_page = sysconf(_SC_PAGESIZE);
+    }
+
+    uintptr_t start = (uintptr_t)&cpu.data[page_addr(page)];
+    uintptr_t end   = start + (uintptr_t)n * MEMORY_PAGE_SIZE;
+
+    start = (start + host_page - 1) & ~(uintptr_t)(host_page - 1);
+    end   = end & ~(uintptr_t)(host_page - 1);
+
+    if (start < end && madvise((void*)start, end - start, MADV_DONTNEED) == 0) {
+        heap.stats.released_bytes += end - start;
+    }
+}
+
+static void free_pages(u32 page, u32 n)
+{
+    release_pages(page, n);
+    mark_pages(page, n, false);
+
+    heap.pages[page].kind = PAGE_FREE;
+    if (page < heap.hint) {
+        heap.hint = page;
+    }
+    heap.stats.committed_bytes -= (u64)n * MEMORY_PAGE_SIZE;
+}
+
+static void partial_push(int class, u32 page)
+{
+    struct page* p = &heap.pages[page];
+
+    p->prev = 0;
+    p->next = heap.partial[class];
+    if (p->next) {
+        heap.pages[p->next - 1].prev = page + 1;
+    }
+    heap.partial[class] = page + 1;
+}
+
+static void partial_remove(int class, u32 page)
+{
+    struct page* p = &heap.pages[page];
+
+    if (p->prev) {
+        heap.pages[p->prev - 1].next = p->next;
+    } else {
+        heap.partial[class] = p->next;
+    }
+
+    if (p->next) {
+        heap.pages[p->next - 1].prev = p->prev;
+    }
+}
+
+static void account_alloc(u32 bytes)
+{
+    heap.stats.allocs++;
+    heap.stats.live_bytes += bytes;
+    if (heap.stats.live_bytes > heap.stats.peak_bytes) {
+        heap.stats.peak_bytes = heap.stats.live_bytes;
+    }
+}
+
+static void account_free(u32 bytes)
+{
+    heap.stats.frees++;
+    heap.stats.live_bytes -= bytes;
+}
+
+static u32 slab_alloc(int class)
+{
+    u32 page;
+
+    if (heap.partial[class]) {
+        page = heap.partial[class] - 1;
+    } else {
+        int fresh = alloc_pages(1);
+        if (fresh < 0) {
+            return 0;
+        }
+
+        page = fresh;
+        heap.pages[page] = (struct page) {
+            .kind  = PAGE_SLAB,
+            .class = class,
+            .nfree = slab_capacity(class),
+        };
+        partial_push(class, page);
+    }
+
+    struct page* p = &heap.pages[page];
+    u32          slot;
+
+    for (int w = 0;; w++) {
+        if (p->used[w] != ~0ull) {
+            slot = w * 64 + __builtin_ctzll(~p->used[w]);
+            p->used[w] |= 1ull << (slot % 64);
+            break;
+        }
+    }
+
+    if (--p->nfree == 0) {
+        partial_remove(class, page);
+    }
+
+    account_alloc(class_size(class));
+    return page_addr(page) + slot * class_size(class);
+}
+
+static u32 large_alloc(u32 size)
+{
+    u32 n    = (size + MEMORY_PAGE_SIZE - 1) / MEMORY_PAGE_SIZE;
+    int page = alloc_pages(n);
+
+    if (page < 0) {
+        return 0;
+    }
+
+    heap.pages[page] = (struct page) {
+        .kind   = PAGE_LARGE,
+        .npages = n,
+    };
+
+    account_alloc(n * MEMORY_PAGE_SIZE);
+    return page_addr(page);
+}
+
+// Size of the block at addr, or 0 when addr is not a live allocation
+static u32 usable_size(u32 addr)
+{
+    if (addr < HEAP_BASE || addr >= HEAP_BASE + HEAP_SIZE) {
+        return 0;
+    }
+
+    u32          page = (addr - HEAP_BASE) / MEMORY_PAGE_SIZE;
+    u32          offs = (addr - HEAP_BASE) % MEMORY_PAGE_SIZE;
+    struct page* p    = &heap.pages[page];
+
+    switch (p->kind) {
+    case PAGE_SLAB: {
+        u32 slot = offs / class_size(p->class);
+        if (offs % class_size(p->class) != 0
+            || !(p->used[slot / 64] & (1ull << (slot % 64)))) {
+            return 0;
+        }
+        return class_size(p->class);
+    }
+
+    case PAGE_LARGE:
+        return offs == 0 ? p->npages * MEMORY_PAGE_SIZE : 0;
+
+    default:
+        return 0;
+    }
+}
+
+u32 heap_malloc(u32 size)
+{
+    if (size == 0 || size > HEAP_SIZE) {
+        return 0;
+    }
+
+    u32 addr = size <= HEAP_MAX_SMALL ? slab_alloc(size_class(size))
+                                      : large_alloc(size);
+
+    trace_event(EV_HEAP_ALLOC, addr, size);
+    return addr;
+}
+
+void heap_free(u32 addr)
+{
+    if (addr == 0) {
+        return;
+    }
+
+    if (usable_size(addr) == 0) {
+        trapf(TRAP_HEAP, "heap: invalid free of 0x%08x", addr);
+        return;
+    }
+
+    u32          page = (addr - HEAP_BASE) / MEMORY_PAGE_SIZE;
+    struct page* p    = &heap.pages[page];
+
+    trace_event(EV_HEAP_FREE, addr, 0);
+
+    if (p->kind == PAGE_LARGE) {
+        account_free(p->npages * MEMORY_PAGE_SIZE);
+        free_pages(page, p->npages);
+        return;
+    }
+
+    int class = p->class;
+    u32 slot  = (addr - page_addr(page)) / class_size(class);
+
+    p->used[slot / 64] &= ~(1ull << (slot % 64));
+    account_free(class_size(class));
+
+    if (p->nfree++ == 0) {
+        partial_push(class, page);
+    }
+
+    if (p->nfree == slab_capacity(class)) {
+        partial_remove(class, page);
+        free_pages(page, 1);
+    }
+}
+
+u32 heap_realloc(u32 addr, u32 size)
+{
+    if (addr == 0) {
+        return heap_malloc(size);
+    }
+
+    if (size == 0) {
+        heap_free(addr);
+        return 0;
+    }
+
+    u32 old = usable_size(addr);
+
+    if (old == 0) {
+        trapf(TRAP_HEAP, "heap: invalid realloc of 0x%08x", addr);
+        return 0;
+    }
+
+    if (size <= old && (size > HEAP_MAX_SMALL || size > old / 2)) {
+        return addr;
+    }
+
+    u32 moved = heap_malloc(size);
+
+    if (moved != 0) {
+        memcpy(&cpu.data[moved], &cpu.data[addr], size < old ? size : old);
+        heap_free(addr);
+    }
+
+    return moved;
+}
+
+u32 heap_calloc(u32 n, u32 size)
+{
+    if (size != 0 && n > HEAP_SIZE / size) {
+        return 0;
+    }
+
+    u32 addr = heap_malloc(n * size);
+
+    if (addr != 0) {
+        memset(&cpu.data[addr], 0, n * size);
+    }
+
+    return addr;
+}
+
+void heap_service()
+{
+    u32 arg0 = cpu.gpr[EBX];
+    u32 arg1 = cpu.gpr[ECX];
+
+    switch (cpu.gpr[EAX]) {
+    case HEAP_MALLOC:
+        cpu.gpr[EAX] = heap_malloc(arg0);
+        break;
+
+    case HEAP_FREE:
+        heap_free(arg0);
+        cpu.gpr[EAX] = 0;
+        break;
+
+    case HEAP_REALLOC:
+        cpu.gpr[EAX] = heap_realloc(arg0, arg1);
+        break;
+
+    case HEAP_CALLOC:
+        cpu.gpr[EAX] = heap_calloc(arg0, arg1);
+        break;
+
+    default:
+        trapf(TRAP_HEAP, "heap: unknown service %u", cpu.gpr[EAX]);
+        break;
+    }
+}
+
+struct heap_stats heap_stats()
+{
+    return heap.stats;
+}
+
+// Share of the committed heap pages that does not hold live blocks
+double heap_fragmentation()
+{
+    if (heap.stats.committed_bytes == 0) {
+        return 0.0;
+    }
+
+    return 1.0 - (double)heap.stats.live_bytes / heap.stats.committed_bytes;
+}
+
+bool heap_dump(bool (*out)(const void* buf, size_t len))
+{
+    bool ok = out(heap.page_used, sizeof(heap.page_used))
+        && out(heap.partial, sizeof(heap.partial)) && out(&heap.hint, sizeof(heap.hint))
+        && out(&heap.stats, sizeof(heap.stats));
+
+    for (u32 page = 0; ok && page < HEAP_PAGES; page++) {
+        if (page_is_used(page)) {
+            ok = out(&heap.pages[page], sizeof(heap.pages[page]));
+        }
+    }
+
+    return ok;
+}
+
+// The links are followed later without checks, a dump is only taken back
+// with every one of them in range
+static bool page_valid(u32 page, const struct page* p)
+{
+    return p->kind <= PAGE_LARGE && p->class < HEAP_CLASSES && p->next <= HEAP_PAGES
+        && p->prev <= HEAP_PAGES && p->npages <= HEAP_PAGES - page;
+}
+
+static bool read_heap(FILE* file)
+{
+    if (fread(heap.page_used, sizeof(heap.page_used), 1, file) != 1
+        || fread(heap.partial, sizeof(heap.partial), 1, file) != 1
+        || fread(&heap.hint, sizeof(heap.hint), 1, file) != 1
+        || fread(&heap.stats, sizeof(heap.stats), 1, file) != 1 || heap.hint > HEAP_PAGES) {
+        return false;
+    }
+
+    for (int class = 0; class < HEAP_CLASSES; class++) {
+        if (heap.partial[class] > HEAP_PAGES) {
+            return false;
+        }
+    }
+
+    for (u32 page = 0; page < HEAP_PAGES; page++) {
+        if (page_is_used(page)
+            && (fread(&heap.pages[page], sizeof(heap.pages[page]), 1, file) != 1
+                || !page_valid(page, &heap.pages[page]))) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+int heap_undump(FILE* file)
+{
+    memset(&heap, 0, sizeof(heap));
+
+    if (!read_heap(file)) {
+        memset(&heap, 0, sizeof(heap));
+        return -1;
+    }
+
+    return 0;
+}
+
+void print_heap_stats()
+{
+    struct heap_stats stats = heap_stats();
+
+    printf("heap allocs %llu frees %llu\n", (unsigned long long)stats.allocs,
+        (unsigned long long)stats.frees);
+    printf("heap live %llu peak %llu committed %llu released %llu\n",
+        (unsigned long long)stats.live_bytes, (unsigned long long)stats.peak_bytes,
+        (unsigned long long)stats.committed_bytes, (unsigned long long)stats.released_bytes);
+    printf("heap fragmentation %.1f%%\n", 100.0 * heap_fragmentation());
+}
@@ -0,0 +1,70 @@
+#ifndef HEAP_H_
+#define HEAP_H_
+
+#include "mem.h"
+#include <stdbool.h>
+#include <stdio.h>
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//   Guest heap service
+//
+//   Guest code reaches the allocator through `int 0x21` with the service
+//   number in %eax and its arguments in %ebx and %ecx. The result, a guest
+//   address or 0 on failure, is returned in %eax.
+//
+//   +---------+--------------+------+------+
+//   | service |     %eax     | %ebx | %ecx |
+//   +---------+--------------+------+------+
+//   | malloc  | HEAP_MALLOC  | size |      |
+//   | free    | HEAP_FREE    | addr |      |
+//   | realloc | HEAP_REALLOC | addr | size |
+//   | calloc  | HEAP_CALLOC  | n    | size |
+//   +---------+--------------+------+------+
+//
+//   The heap spans [HEAP_BASE, HEAP_BASE + HEAP_SIZE) of guest memory and
+//   is carved in MEMORY_PAGE_SIZE pages. Requests up to HEAP_MAX_SMALL bytes
+//   come from per size class slabs, larger ones get a run of pages. All the
+//   bookkeeping lives on the host side, so a guest overrunning a block can
+//   not corrupt the allocator.
+//
+
+#define INT_HEAP 0x21
+
+#define HEAP_MIN_SMALL 16
+#define HEAP_MAX_SMALL 4096
+
+enum heap_service {
+    HEAP_MALLOC,
+    HEAP_FREE,
+    HEAP_REALLOC,
+    HEAP_CALLOC,
+};
+
+struct heap_stats {
+    u64 allocs;
+    u64 frees;
+    u64 live_bytes;      // bytes handed out, rounded up to the size class
+    u64 peak_bytes;      // high-water mark of live_bytes
+    u64 committed_bytes; // pages backing slabs and large blocks
+    u64 released_bytes;  // bytes given back to the host with madvise
+};
+
+u32 heap_malloc(u32 size);
+void heap_free(u32 addr);
+u32 heap_realloc(u32 addr, u32 size);
+u32 heap_calloc(u32 n, u32 size);
+
+void heap_service();
+
+struct heap_stats heap_stats();
+double heap_fragmentation();
+void print_heap_stats();
+
+// The allocator state in crash dumps (dump.h): the page bitmap, lists and
+// statistics, then the entries of the pages in use. heap_dump() hands it
+// to out, which may be called from a signal handler.
+bool heap_dump(bool (*out)(const void* buf, size_t len));
+int  heap_undump(FILE* file);
+
+#endif /* HEAP_H_ */
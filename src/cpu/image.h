@@ -0,0 +1,57 @@
+#ifndef IMAGE_H_
+#define IMAGE_H_
+
+#include "mem.h"
+#include "opcode.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//   Image format
+//
+//   +--------------+
+//   |  hdr_magic   |  8 bytes
+//   +--------------+
+//   |   text_len   |  8 bytes
+//   +--------------+
+//   |  total_len   |  8 bytes
+//   +--------------+
+//   |     isa      |  8 bytes, ISA_V1 or ISA_V2, not in HDR_MAGIC images
+//   +--------------+
+//   |   padding    |  up to IMAGE_TEXT_OFFSET, HDR_MAGIC_PAGED only
+//   +--------------+
+//   |     text     |  text_len bytes, loaded at address 0
+//   +--------------+
+//   |     data     |  total_len - text_len bytes, follows text
+//   +--------------+
+//
+//   Images with the older HDR_MAGIC have no isa field and are ISA_V1.
+//
+//   The loader seals the text read-only (verify.h), so data must not share
+//   a host page with it: the assembler starts data at a multiple of
+//   IMAGE_DATA_ALIGN, and images with data on the text's last page are
+//   refused.
+//
+//   With HDR_MAGIC_PAGED text starts on a page boundary of the file, and
+//   the loader maps the data into guest memory instead of copying it.
+//   The mapping is private, so pages the guest never writes stay shared
+//   through the page cache with every other process running the same
+//   image. The text is copied: the verified text must not follow later
+//   writes to the file. Images are replaced by renaming a new file over
+//   them, never rewritten in place, as the assembler does.
+//
+
+#define HDR_MAGIC 0x6865787944414e4f
+#define HDR_MAGIC_ISA 0x6965787944414e4f
+#define HDR_MAGIC_PAGED 0x6a65787944414e4f
+
+#define IMAGE_TEXT_OFFSET (1 << 14) // MEMORY_PAGE_SIZE
+#define IMAGE_DATA_ALIGN (1 << 14)
+
+struct image_header {
+    u64 magic;
+    u64 text_len;
+    u64 total_len;
+    u64 isa;
+};
+
+#endif /* IMAGE_H_ */
@@ -0,0 +1,317 @@
+#include "insn.h"
+#include <stdio.h>
+#include <string.h>
+
+enum field {
+    F_END,
+    F_REG,  // register of the operand size
+    F_BASE, // base register of a memory operand
+    F_OFFS, // its 16 bit offset
+    F_IMM,  // immediate of the operand size
+    F_XMM,
+    F_GPR,
+    F_IMM8,
+};
+
+static const u8 fields[][4] = {
+    [L_RI]   = { F_REG, F_IMM },
+    [L_RR]   = { F_REG, F_REG },
+    [L_RM]   = { F_REG, F_BASE, F_OFFS },
+    [L_MI]   = { F_BASE, F_OFFS, F_IMM },
+    [L_MR]   = { F_BASE, F_OFFS, F_REG },
+    [L_R]    = { F_REG },
+    [L_XX]   = { F_XMM, F_XMM },
+    [L_XXX]  = { F_XMM, F_XMM, F_XMM },
+    [L_XG]   = { F_XMM, F_GPR },
+    [L_GX]   = { F_GPR, F_XMM },
+    [L_I8]   = { F_IMM8 },
+    [L_NONE] = { F_END },
+};
+
+// In v2 registers live in the first word and every other field is one
+// or more whole words
+static int field_len(enum isa isa, enum field field, enum operand_size size)
+{
+    switch (field) {
+    case F_END:
+        return 0;
+    case F_OFFS:
+        return isa == ISA_V2 ? V2_WORD : sizeof(u16);
+    case F_IMM:
+        return isa == ISA_V2 && size < QWORD ? V2_WORD : 1 << size;
+    case F_IMM8:
+        return isa == ISA_V2 ? V2_WORD : 1;
+    default:
+        return isa == ISA_V2 ? 0 : 1;
+    }
+}
+
+static int head_len(enum isa isa)
+{
+    return isa == ISA_V2 ? V2_WORD : 1;
+}
+
+const char* reg_name(enum operand_size size, int reg)
+{
+    switch (size) {
+    case BYTE:
+        return reg < 16 && (reg & 2) == 0 ? r8_str(reg) : NULL;
+    case WORD:
+        return reg <= IP && (reg & 1) == 0 ? r16_str(reg) : NULL;
+    case DWORD:
+        return reg <= R15 ? r32_str(reg) : NULL;
+    case QWORD:
+        return reg <= XMM7 ? r64_str(reg) : NULL;
+    }
+
+    return NULL;
+}
+
+bool layout_sized(enum layout layout)
+{
+    return layout <= L_R;
+}
+
+int insn_len(enum isa isa, enum layout layout, enum operand_size size)
+{
+    int len = head_len(isa);
+
+    for (const u8* f = fields[layout]; *f != F_END; f++) {
+        len += field_len(isa, *f, size);
+    }
+
+    return len;
+}
+
+static int field_pos(enum isa isa, enum layout layout, enum field field)
+{
+    int pos = head_len(isa);
+
+    for (const u8* f = fields[layout]; *f != F_END; f++) {
+        if (*f == field) {
+            return pos;
+        }
+        // immediates are last, their width does not matter here
+        pos += field_len(isa, *f, BYTE);
+    }
+
+    return 0;
+}
+
+enum operand_size insn_reg_size(const struct insn* insn, int n)
+{
+    const u8* f = fields[opcodes[insn->op].layout];
+
+    for (; *f != F_END; f++) {
+        if (*f != F_OFFS && *f != F_IMM && *f != F_IMM8 && n-- == 0) {
+            break;
+        }
+    }
+
+    switch (*f) {
+    case F_REG:
+        return insn->size;
+    case F_XMM:
+        return QWORD;
+    default:
+        return DWORD;
+    }
+}
+
+int insn_regs(enum layout layout)
+{
+    int n = 0;
+
+    for (const u8* f = fields[layout]; *f != F_END; f++) {
+        n += *f != F_OFFS && *f != F_IMM && *f != F_IMM8;
+    }
+
+    return n;
+}
+
+int insn_offs_pos(enum isa isa, enum layout layout)
+{
+    return field_pos(isa, layout, F_OFFS);
+}
+
+int insn_imm_pos(enum isa isa, enum layout layout)
+{
+    int pos = field_pos(isa, layout, F_IMM);
+    return pos ? pos : field_pos(isa, layout, F_IMM8);
+}
+
+int insn_offs_len(enum isa isa)
+{
+    return field_len(isa, F_OFFS, BYTE);
+}
+
+int decode_insn(enum isa isa, const u8* code, u32 len, struct insn* insn)
+{
+    u32 word = 0;
+
+    if (isa == ISA_V2) {
+        if (len < V2_WORD) {
+            return -1;
+        }
+        memcpy(&word, code, sizeof(word));
+        *insn = (struct insn) { .op = V2_OP(word), .size = word & 0x03 };
+    } else {
+        *insn = (struct insn) { .op = code[0], .size = len > 1 ? code[1] & 0x03 : 0 };
+    }
+
+    const struct opcode_info* info = &opcodes[insn->op];
+
+    if (info->name == NULL) {
+        return -1;
+    }
+
+    if (!layout_sized(info->layout)) {
+        insn->size = 0;
+    }
+
+    insn->len = insn_len(isa, info->layout, insn->size);
+    if (insn->len > len) {
+        return -1;
+    }
+
+    const u8* p = code + head_len(isa);
+    int       n = 0;
+
+    for (const u8* f = fields[info->layout]; *f != F_END; f++) {
+        switch (*f) {
+        case F_OFFS:
+            if (isa == ISA_V2) {
+                memcpy(&insn->offs, p, sizeof(insn->offs));
+            } else {
+                i16 offs;
+                memcpy(&offs, p, sizeof(offs));
+                insn->offs = offs;
+            }
+            break;
+        case F_IMM:
+            memcpy(&insn->imm, p, 1 << insn->size); // little-endian host
+            break;
+        case F_IMM8:
+            insn->imm = *p;
+            break;
+        default:
+            insn->reg[n] = isa == ISA_V2 ? V2_REG(word, n) : *p >> 2;
+            n++;
+            break;
+        }
+        p += field_len(isa, *f, insn->size);
+    }
+
+    return insn->len;
+}
+
+int encode_insn(enum isa isa, u8* code, const struct insn* insn)
+{
+    enum layout layout = opcodes[insn->op].layout;
+    u8*         p      = code + head_len(isa);
+    u32         word   = insn->op << 2 | (layout_sized(layout) ? insn->size : 0);
+    int         n      = 0;
+
+    memset(code, 0, insn_len(isa, layout, insn->size));
+
+    for (const u8* f = fields[layout]; *f != F_END; f++) {
+        // in v1 the first operand byte carries the operand size
+        u8 size = p == code + 1 && layout_sized(layout) ? insn->size : DWORD;
+
+        switch (*f) {
+        case F_OFFS:
+            memcpy(p, &insn->offs, field_len(isa, F_OFFS, BYTE));
+            break;
+        case F_IMM:
+            memcpy(p, &insn->imm, 1 << insn->size);
+            break;
+        case F_IMM8:
+            *p = (u8)insn->imm;
+            break;
+        default:
+            if (isa == ISA_V2) {
+                word |= (u32)insn->reg[n] << V2_REG_SHIFT(n);
+            } else if (*f == F_REG) {
+                *p = insn->size | insn->reg[n] << 2;
+            } else if (*f == F_XMM) {
+                *p = QWORD | insn->reg[n] << 2;
+            } else {
+                *p = size | insn->reg[n] << 2;
+            }
+            n++;
+            break;
+        }
+        p += field_len(isa, *f, insn->size);
+    }
+
+    if (isa == ISA_V2) {
+        memcpy(code, &word, sizeof(word));
+    } else {
+        code[0] = insn->op;
+    }
+
+    return p - code;
+}
+
+int format_insn(char* buf, size_t size, const struct insn* insn)
+{
+    static const char suffix[] = "bwlq";
+
+    const struct opcode_info* info = &opcodes[insn->op];
+    char                      text[64];
+    int                       len = 0;
+    int                       n   = 0;
+    const char*               sep = " ";
+
+    if (info->name == NULL) {
+        return snprintf(buf, size, ".byte 0x%02x", insn->op);
+    }
+
+    len += snprintf(text + len, sizeof(text) - len, "%s", info->mnemonic);
+    if (info->layout == L_MI) {
+        len += snprintf(text + len, sizeof(text) - len, "%c", suffix[insn->size]);
+    }
+
+    for (const u8* f = fields[info->layout]; *f != F_END; f++, sep = ", ") {
+        const char* name = NULL;
+        int         reg  = insn->reg[n];
+
+        switch (*f) {
+        case F_REG:
+            name = reg_name(insn->size, reg);
+            break;
+        case F_GPR:
+            name = reg_name(DWORD, reg);
+            break;
+        case F_XMM:
+            name = reg_name(QWORD, reg);
+            break;
+        case F_BASE:
+            name = reg_name(DWORD, reg);
+            len += snprintf(text + len, sizeof(text) - len, "%s[", sep);
+            sep = "";
+            break;
+        case F_OFFS:
+            if (insn->offs != 0) {
+                len += snprintf(text + len, sizeof(text) - len, " %c %d",
+                    insn->offs < 0 ? '-' : '+', insn->offs < 0 ? -insn->offs : insn->offs);
+            }
+            len += snprintf(text + len, sizeof(text) - len, "]");
+            continue;
+        case F_IMM:
+        case F_IMM8:
+            len += snprintf(text + len, sizeof(text) - len, "%s0x%llx", sep,
+                (unsigned long long)insn->imm);
+            continue;
+        }
+
+        if (name != NULL) {
+            len += snprintf(text + len, sizeof(text) - len, "%s%%%s", sep, name);
+        } else {
+            len += snprintf(text + len, sizeof(text) - len, "%s%%?%d", sep, reg);
+        }
+        n++;
+    }
+
+    return snprintf(buf, size, "%s", text);
+}
@@ -0,0 +1,59 @@
+#ifndef INSN_H_
+#define INSN_H_
+
+#include "mem.h"
+#include "opcode.h"
+#include "register.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//   Instructions
+//
+//   Table driven decoder, encoder and disassembler for the layouts of
+//   opcode.h in either encoding, used by the tools. exec() does not go
+//   through them, its handlers decode their operands inline.
+//
+//   Operands are kept in assembly order. reg[] holds the register
+//   operands, a memory operand contributes its base register, so
+//   `mov [%eax + 3], %ebx` has reg = { EAX, EBX } and offs = 3.
+//
+
+#define INSN_MAX 16
+
+struct insn {
+    u8  op;
+    u8  size; // operand size, sized layouts only
+    u8  len;  // encoded length in bytes
+    u8  reg[3];
+    i32 offs; // 16 bits in v1
+    u64 imm;
+};
+
+bool layout_sized(enum layout layout);
+int  insn_len(enum isa isa, enum layout layout, enum operand_size size);
+
+// Position and width of the offset and immediate fields in an encoding,
+// the position is 0 if the layout has none
+int insn_offs_pos(enum isa isa, enum layout layout);
+int insn_imm_pos(enum isa isa, enum layout layout);
+int insn_offs_len(enum isa isa);
+
+// Returns the length of the instruction at code, -1 for an unassigned
+// opcode or an instruction longer than len
+int decode_insn(enum isa isa, const u8* code, u32 len, struct insn* insn);
+int encode_insn(enum isa isa, u8* code, const struct insn* insn);
+
+// Number of register operands of a layout, and the size of register n
+// of an instruction, base registers being dwords
+int               insn_regs(enum layout layout);
+enum operand_size insn_reg_size(const struct insn* insn, int n);
+
+// Name of a register, NULL if the index is not one of that size
+const char* reg_name(enum operand_size size, int reg);
+
+// Writes `mov %eax, [%ebx + 12]` style text, as snprintf does
+int format_insn(char* buf, size_t size, const struct insn* insn);
+
+#endif /* INSN_H_ */
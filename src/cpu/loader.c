@@ -1,18 +1,127 @@
 #include "cpu.h"
+#include "cache.h"
+#include "dump.h"
+#include "image.h"
+#include "insn.h"
+#include "register.h"
+#include "stats.h"
+#include "verify.h"
 #include <stdio.h>
-
-#define HDR_MAGIC 0x6865787944414e4f
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 static FILE* file;
 
-static int check_header()
+static u64 check_header()
 {
     uint64_t hdr_magic = 0;
 
     // fseek(file, 0, SEEK_SET);
     fread(&hdr_magic, sizeof(hdr_magic), 1, file);
 
-    return hdr_magic == HDR_MAGIC;
+    switch (hdr_magic) {
+    case HDR_MAGIC:
+    case HDR_MAGIC_ISA:
+    case HDR_MAGIC_PAGED:
+    case DUMP_MAGIC:
+        return hdr_magic;
+    }
+
+    return 0;
+}
+
+// Maps the data of a paged image over guest memory, privately so guest
+// writes stay in this process. The text pages are read instead: a mapping
+// sealed read-only is never copied and keeps following the file, which
+// could then change under the verified text. Only done when the file ends
+// with the data, the rest of the last page then reads as zeros like the
+// guest memory it replaces, and the pages past it are left alone. -1 if
+// the host can not map it, the image is read instead.
+static int map_image(size_t text_len, size_t total_len)
+{
+    struct stat st;
+    size_t      page = sysconf(_SC_PAGESIZE);
+
+    if (fstat(fileno(file), &st) != 0 || (size_t)st.st_size != IMAGE_TEXT_OFFSET + total_len) {
+        return -1;
+    }
+
+    size_t len      = (total_len + page - 1) / page * page;
+    size_t text_end = (text_len + page - 1) / page * page;
+
+    if (text_end >= len) {
+        return -1;
+    }
+
+    if (pread(fileno(file), cpu.data, text_end, IMAGE_TEXT_OFFSET) != (ssize_t)text_end
+        || mmap(cpu.data + text_end, len - text_end, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_FIXED, fileno(file), IMAGE_TEXT_OFFSET + text_end)
+            == MAP_FAILED) {
+        return -1;
+    }
+
+    return 0;
+}
+
+// Load errors go to stderr as well, the trace only has them with
+// CPU_TRACE set
+static int load_error(const char* path, const char* message)
+{
+    trace(message);
+    fprintf(stderr, "%s: %s\n", path, message);
+    fclose(file);
+    return -1;
+}
+
+// Prints why an image was rejected along with the instruction at fault,
+// as far as it decodes
+static void report(const char* path, u32 text_len, const struct verify_error* err)
+{
+    struct insn insn;
+    char        text[80] = "";
+
+    if (err->offset < text_len
+        && decode_insn(cpu.isa, cpu.data + err->offset, INSN_MAX, &insn) > 0) {
+        format_insn(text, sizeof(text), &insn);
+    }
+
+    fprintf(stderr, "%s: text+0x%x: %s%s%s\n", path, err->offset, err->reason,
+        *text ? ": " : "", text);
+}
+
+// Older images put data right after the text, on the page verify() seals
+static bool data_on_text_page(u32 text_len, u32 total_len)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t end  = ((size_t)text_len + page - 1) / page * page;
+
+    for (size_t i = text_len; i < end && i < total_len; i++) {
+        if (cpu.data[i] != 0) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Verifies the loaded text, unless the code cache already knows it
+static int verify_text(const char* path, u32 text_len)
+{
+    if (cache_load(text_len) == 0) {
+        return 0;
+    }
+
+    struct verify_error err;
+    u64                 start = stats_clock();
+
+    if (verify(text_len, &err) != 0) {
+        report(path, text_len, &err);
+        return -1;
+    }
+
+    cache_save(text_len, stats_clock() - start);
+    return 0;
 }
 
 int load(char* path)
@@ -23,34 +132,84 @@ int load(char* path)
 
     if (file == NULL) {
         tracep();
+        perror(path);
         return -1;
     }
 
-    if (!check_header()) {
-        trace("unrecognized file");
-        return -1;
+    u64 magic = check_header();
+
+    if (magic == 0) {
+        return load_error(path, "unrecognized file");
+    }
+
+    // a dump resumes where the guest stopped
+    if (magic == DUMP_MAGIC) {
+        u32 text_len;
+
+        int err = dump_load(file, &text_len);
+
+        if (err == -2) {
+            return load_error(path, "dump of a host signal, it can not be resumed");
+        } else if (err != 0) {
+            return load_error(path, "corrupted dump");
+        }
+        fclose(file);
+
+        if (verify_text(path, text_len) != 0) {
+            return -1;
+        }
+
+        // exec() runs from %eip, and traps go to the handler, unchecked
+        if (!insn_start(cpu.gpr[EIP]) || cpu.gpr[ESP] > MEMORY_SIZE - 4
+            || (cpu.trap_handler != 0 && !insn_start(cpu.trap_handler))) {
+            fprintf(stderr, "%s: %%eip, %%esp or trap handler out of range\n", path);
+            return -1;
+        }
+        return 0;
     }
 
     size_t text_len;
     if (fread(&text_len, sizeof(text_len), 1, file) != 1) {
-        trace("corrupted file");
-        fclose(file);
-        return -1;
+        return load_error(path, "corrupted file");
     }
 
     size_t total_len;
     if (fread(&total_len, sizeof(text_len), 1, file) != 1) {
-        trace("corrupted file");
-        fclose(file);
+        return load_error(path, "corrupted file");
+    }
+
+    u64 isa = ISA_V1;
+    if (magic != HDR_MAGIC && fread(&isa, sizeof(isa), 1, file) != 1) {
+        return load_error(path, "corrupted file");
+    }
+
+    if (isa != ISA_V1 && (isa != ISA_V2 || text_len % V2_WORD != 0)) {
+        return load_error(path, "unsupported isa");
+    }
+
+    if (text_len > total_len || total_len > HEAP_BASE) {
+        return load_error(path, "image too large");
+    }
+
+    if (magic == HDR_MAGIC_PAGED && map_image(text_len, total_len) == 0) {
+        tracef("mapped %zu bytes", total_len);
+    } else if ((magic == HDR_MAGIC_PAGED && fseek(file, IMAGE_TEXT_OFFSET, SEEK_SET) != 0)
+        || fread(cpu.data, 1, total_len, file) != total_len) {
+        return load_error(path, "corrupted file");
+    }
+
+    fclose(file);
+    cpu.isa = isa;
+
+    if (data_on_text_page(text_len, total_len)) {
+        fprintf(stderr, "%s: data shares a page with the text, reassemble the image\n", path);
         return -1;
     }
 
-    if (fread(cpu.data, 1, total_len, file) != total_len) {
-        trace("corrupted file");
-        fclose(file);
+    if (verify_text(path, text_len) != 0) {
         return -1;
     }
 
-    fclose(file);
+    reset();
     return 0;
 }
@@ -1,7 +1,16 @@
+#include "cache.h"
 #include "cpu.h"
+#include "debug.h"
+#include "dump.h"
 #include "encode.h"
+#include "heap.h"
+#include "profile.h"
 #include "register.h"
+#include "stats.h"
+#include "verify.h"
+#include "watch.h"
 #include <stdio.h>
+#include <stdlib.h>
 
 void print_text()
 {
@@ -22,6 +31,8 @@ void print_regs()
     for (int i = 0; i < 8; i++) {
         printf("xmm%d 0x%016llx\n", i, cpu.xmm[i]);
     }
+
+    printf("flags 0x%08x\n", cpu.flags);
 }
 
 void print_stack()
@@ -31,9 +42,13 @@ void print_stack()
     }
 }
 
-int main(void)
+// Built-in program run when no image is given
+int demo()
 {
-    u8* ip = cpu.data;
+    u8*                 ip = cpu.data;
+    struct verify_error err;
+
+    cpu.isa = ISA_V1;
 
     *ip++ = MOV_RI;
     *ip++ = encode_r32(EDX);
@@ -46,8 +61,8 @@ int main(void)
     *ip++ = MOV_RI;
     *ip++ = encode_r16(SI);
     *ip++ = 0x12;
-    *ip++ = 0x13;
-    // mov %si, 0x1312
+    *ip++ = 0x43;
+    // mov %si, 0x4312
 
     *ip++ = MOV_MR;
     *ip++ = encode_r32(ESI);
@@ -73,9 +88,46 @@ int main(void)
 
     *ip++ = HALT;
 
+    reset();
+    return verify(ip - cpu.data, &err);
+}
+
+int main(int argc, char** argv)
+{
+    if (argc > 2) {
+        fprintf(stderr, "usage: %s [image]\n", argv[0]);
+        return 1;
+    }
+
+    stats_init();
+    trace_open(getenv("CPU_TRACE"));
+    profile_start(getenv("CPU_PROFILE"));
+
+    if (dump_start(getenv("CPU_DUMP")) != 0) {
+        return 1;
+    }
+
+    if (argc == 2) {
+        cache_open(getenv("CPU_CACHE"));
+        if (load(argv[1]) != 0) {
+            return 1;
+        }
+    } else if (demo() != 0) {
+        return 1;
+    }
+
+    if (debug_start(getenv("CPU_GDB")) != 0 || watch_start(getenv("CPU_WATCH")) != 0) {
+        return 1;
+    }
+
     exec();
 
+    watch_stop();
+    debug_stop();
+    profile_stop();
     print_regs();
+    print_heap_stats();
 
+    trace_close();
     return 0;
 }
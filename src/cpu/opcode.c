@@ -0,0 +1,17 @@
+#include "opcode.h"
+#include <stddef.h>
+
+const struct opcode_info opcodes[256] = {
+#define X(OPCODE, value, name, mnemonic, layout) [OPCODE] = { #name, #mnemonic, L_##layout },
+    OPCODES(X)
+#undef X
+};
+
+char* opcode_str(enum opcode op)
+{
+    if ((unsigned)op < 256 && opcodes[op].name != NULL) {
+        return (char*)opcodes[op].name;
+    }
+
+    return "unknown";
+}
@@ -1,6 +1,8 @@
 #ifndef OPCODE_H_
 #define OPCODE_H_
 
+#include "mem.h"
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 //   Specifications
@@ -64,54 +66,161 @@
 //   +-------------------+-------------------+-------------------+-------------------+-------------------+-------------------+
 //
 
-enum opcode {
+////////////////////////////////////////////////////////////////////////////////
+//
+//   IV. Operand layouts
+//
+//   Every instruction is an opcode byte followed by the operands of its
+//   layout, in the order they are written in assembly:
+//
+//   +--------+------------------------------+-------------------------------+
+//   | layout | encoding                     | example                       |
+//   +--------+------------------------------+-------------------------------+
+//   |   RI   | X X ssrr R I...              | mov %eax, 0xff0a              |
+//   |   RR   | X X ssrr R ssrr R            | mov %eax, %ebx                |
+//   |   RM   | X X ssrr R --rr R O O O O    | mov %eax, [%ebx + 12345]      |
+//   |   MI   | X X ssrr R O O O O I...      | movl [%eax + 12345], 0xff0a   |
+//   |   MR   | X X ssrr R O O O O ssrr R    | mov [%eax + 12345], %ebx      |
+//   |   R    | X X ssrr R                   | push %eax                     |
+//   |   XX   | X X aarr R aarr R            | addsd %xmm0, %xmm1            |
+//   |   XXX  | X X aarr R aarr R aarr R     | fmaddsd %xmm0, %xmm1, %xmm2   |
+//   |   XG   | X X aarr R aarr R            | cvtsi2sd %xmm0, %eax          |
+//   |   GX   | X X aarr R aarr R            | cvttsd2si %eax, %xmm0         |
+//   |   I8   | X X I I                      | int 0x21                      |
+//   |  NONE  | X X                          | halt                          |
+//   +--------+------------------------------+-------------------------------+
+//
+//   The first six layouts are sized: the size bits `ss` of the first
+//   operand byte give the operand size, immediates are that wide and
+//   offsets count operands, not bytes. The others always work on xmm (X)
+//   and dword (G) registers.
+//
+//
+//   V. Opcodes
+//
+//   OPCODES(X) lists every instruction as
+//
+//       X(OPCODE, value, name, mnemonic, layout)
+//
+//   and everything else is expanded from it: the enum below, opcode_str(),
+//   the decoder, encoder and disassembler in insn.c, the assembler's
+//   instruction table and the handlers of exec(), one per opcode and
+//   operand size. exec() calls op_<name>() for each opcode.
+//
+//   cmp sets CF, PF, AF, ZF, SF and OF from dst - src like its x86
+//   counterpart. Scalar floating point operates on the low double (sd) or
+//   the low single (ss) held in an xmm register, single precision writes
+//   leave the upper 32 bits of the destination untouched. comisd sets ZF,
+//   PF and CF: unordered 1 1 1, less 0 0 1, equal 1 0 0, greater 0 0 0.
+//   cvttsd2si truncates toward zero, out of range values and NaN give
+//   0x80000000. fmaddsd computes xmm0 = xmm1 * xmm2 + xmm0.
+//
+//   brk is reserved for the debugger (debug.h), which patches it over
+//   guest instructions. Loaded text must not contain it.
+//
+//
+//   VI. v2 encoding
+//
+//   Images carry an ISA version. ISA_V1 is the byte encoding above,
+//   ISA_V2 encodes the same instructions in aligned 32 bit words:
+//
+//    31    28 27       22 21       16 15       10 9               2 1   0
+//   +--------+-----------+-----------+-----------+-----------------+-----+
+//   |   0    |    r2     |    r1     |    r0     |     opcode      | ss  |
+//   +--------+-----------+-----------+-----------+-----------------+-----+
+//
+//   followed by one word for the offset of a memory operand (signed, 32
+//   bits, scaled like v1 offsets) and then the immediate: one word, two
+//   for qword immediates. r0, r1 and r2 are the registers of the layout
+//   in assembly order, a memory operand contributing its base register.
+//   The low ten bits are the dispatch key of exec(), every field is
+//   decoded with a shift and a mask from one load.
+//
 
-    //
-    // mov %eax, 0xff0a
-    //
-    // X X aarr R I...
-    //
-    MOV_RI = 0x3a,
+// clang-format off
+#define OPCODES(X)                                      \
+    X(MOV_RI,    0x3a, mov_ri,    mov,       RI)        \
+    X(MOV_RR,    0x3b, mov_rr,    mov,       RR)        \
+    X(MOV_RM,    0x3c, mov_rm,    mov,       RM)        \
+    X(MOV_MI,    0x3d, mov_mi,    mov,       MI)        \
+    X(MOV_MR,    0x3e, mov_mr,    mov,       MR)        \
+    X(PUSH,      0x3f, push,      push,      R)         \
+    X(POP,       0x40, pop,       pop,       R)         \
+    X(CMP_RI,    0x41, cmp_ri,    cmp,       RI)        \
+    X(CMP_RR,    0x42, cmp_rr,    cmp,       RR)        \
+    X(CMP_RM,    0x43, cmp_rm,    cmp,       RM)        \
+    X(CMP_MI,    0x44, cmp_mi,    cmp,       MI)        \
+    X(CMP_MR,    0x45, cmp_mr,    cmp,       MR)        \
+    X(ADDSD,     0x46, addsd,     addsd,     XX)        \
+    X(SUBSD,     0x47, subsd,     subsd,     XX)        \
+    X(MULSD,     0x48, mulsd,     mulsd,     XX)        \
+    X(DIVSD,     0x49, divsd,     divsd,     XX)        \
+    X(MINSD,     0x4a, minsd,     minsd,     XX)        \
+    X(MAXSD,     0x4b, maxsd,     maxsd,     XX)        \
+    X(SQRTSD,    0x4c, sqrtsd,    sqrtsd,    XX)        \
+    X(FMADDSD,   0x4d, fmaddsd,   fmaddsd,   XXX)       \
+    X(COMISD,    0x4e, comisd,    comisd,    XX)        \
+    X(CVTSI2SD,  0x4f, cvtsi2sd,  cvtsi2sd,  XG)        \
+    X(CVTTSD2SI, 0x50, cvttsd2si, cvttsd2si, GX)        \
+    X(ADDSS,     0x51, addss,     addss,     XX)        \
+    X(SUBSS,     0x52, subss,     subss,     XX)        \
+    X(MULSS,     0x53, mulss,     mulss,     XX)        \
+    X(DIVSS,     0x54, divss,     divss,     XX)        \
+    X(MINSS,     0x55, minss,     minss,     XX)        \
+    X(MAXSS,     0x56, maxss,     maxss,     XX)        \
+    X(SQRTSS,    0x57, sqrtss,    sqrtss,    XX)        \
+    X(FMADDSS,   0x58, fmaddss,   fmaddss,   XXX)       \
+    X(COMISS,    0x59, comiss,    comiss,    XX)        \
+    X(CVTSI2SS,  0x5a, cvtsi2ss,  cvtsi2ss,  XG)        \
+    X(CVTTSS2SI, 0x5b, cvttss2si, cvttss2si, GX)        \
+    X(CVTSD2SS,  0x5c, cvtsd2ss,  cvtsd2ss,  XX)        \
+    X(CVTSS2SD,  0x5d, cvtss2sd,  cvtss2sd,  XX)        \
+    X(INT,       0x5e, int,       int,       I8)        \
+    X(NOP,       0x90, nop,       nop,       NONE)      \
+    X(HALT,      0x91, halt,      halt,      NONE)      \
+    X(BRK,       0xcc, brk,       brk,       NONE)
+// clang-format on
 
-    //
-    // mov %eax, %ebx
-    //
-    // X X aarr R aarr R
-    //
-    MOV_RR,
+enum opcode {
+#define X(OPCODE, value, ...) OPCODE = value,
+    OPCODES(X)
+#undef X
+};
 
-    //
-    // mov %eax, [%ebx + 12345]
-    //
-    // X X aarr R --rr R O O O O
-    //
-    MOV_RM,
+enum layout {
+    L_RI,
+    L_RR,
+    L_RM,
+    L_MI,
+    L_MR,
+    L_R,
+    L_XX,
+    L_XXX,
+    L_XG,
+    L_GX,
+    L_I8,
+    L_NONE,
+};
 
-    //
-    // mov [%eax + 12345], 0xff0a
-    //
-    // X X ssrr R O O O O aarr R I I I I
-    //
-    MOV_MI,
+enum isa {
+    ISA_V1 = 1,
+    ISA_V2 = 2,
+};
 
-    //
-    // mov [%eax + 12345], %ebx
-    //
-    // X X --rr R O O O O aarr R
-    //
-    MOV_MR,
+#define V2_WORD 4
+#define V2_KEY 0x3ff
+#define V2_OP(word) ((word) >> 2 & 0xff)
+#define V2_REG_SHIFT(n) (10 + 6 * (n))
+#define V2_REG(word, n) ((word) >> V2_REG_SHIFT(n) & 0x3f)
 
-    PUSH,
-    POP,
+struct opcode_info {
+    const char* name;     // NULL for unassigned opcodes
+    const char* mnemonic;
+    enum layout layout;
+};
 
-    CMP_RI,
-    CMP_RR,
-    CMP_RM,
-    CMP_MI,
-    CMP_MR,
+extern const struct opcode_info opcodes[256];
 
-    NOP = 0x90,
-    HALT,
-};
+char* opcode_str(enum opcode op);
 
 #endif /* OPCODE_H_ */
@@ -0,0 +1,236 @@
+#include "profile.h"
+#include "cpu.h"
+#include "register.h"
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+struct stack {
+    u32 count;
+    u32 depth;
+    u32 frames[PROFILE_DEPTH]; // innermost first
+};
+
+struct address {
+    u32 addr;
+    u32 count;
+};
+
+static struct stack stacks[PROFILE_STACKS];
+
+static volatile sig_atomic_t samples;
+static volatile sig_atomic_t lost;
+static const char*           output;
+
+static u32 hash_frames(const u32* frames, u32 depth)
+{
+    u32 hash = 2166136261u;
+
+    for (u32 i = 0; i < depth; i++) {
+        hash = (hash ^ frames[i]) * 16777619u;
+    }
+
+    return hash;
+}
+
+static u32 walk_stack(u32* frames)
+{
+    volatile u32* gpr   = cpu.gpr;
+    u32           depth = 0;
+    u32           frame = gpr[EBP];
+
+    frames[depth++] = gpr[EIP];
+
+    while (depth < PROFILE_DEPTH && frame != 0
+        && frame <= MEMORY_SIZE - 2 * sizeof(u32)) {
+        u32 caller = *(u32*)&cpu.data[frame];
+
+        frames[depth++] = *(u32*)&cpu.data[frame + sizeof(u32)];
+
+        // frames live at increasing addresses as we unwind
+        if (caller <= frame) {
+            break;
+        }
+        frame = caller;
+    }
+
+    return depth;
+}
+
+static void sample(int sig)
+{
+    (void)sig;
+
+    u32 frames[PROFILE_DEPTH];
+    u32 depth = walk_stack(frames);
+    u32 hash  = hash_frames(frames, depth);
+
+    samples++;
+
+    for (u32 i = 0; i < PROFILE_PROBES; i++) {
+        struct stack* s = &stacks[(hash + i) % PROFILE_STACKS];
+
+        if (s->count == 0) {
+            s->depth = depth;
+            memcpy(s->frames, frames, depth * sizeof(u32));
+        } else if (s->depth != depth
+            || memcmp(s->frames, frames, depth * sizeof(u32)) != 0) {
+            continue;
+        }
+
+        s->count++;
+        return;
+    }
+
+    lost++;
+}
+
+static int by_addr(const void* a, const void* b)
+{
+    const struct address* x = a;
+    const struct address* y = b;
+
+    return (x->addr > y->addr) - (x->addr < y->addr);
+}
+
+static int by_count(const void* a, const void* b)
+{
+    const struct address* x = a;
+    const struct address* y = b;
+
+    return (x->count < y->count) - (x->count > y->count);
+}
+
+static void write_folded(FILE* out)
+{
+    for (u32 i = 0; i < PROFILE_STACKS; i++) {
+        struct stack* s = &stacks[i];
+
+        if (s->count == 0) {
+            continue;
+        }
+
+        for (u32 f = s->depth; f-- > 0;) {
+            fprintf(out, "0x%08x%s", s->frames[f], f ? ";" : "");
+        }
+        fprintf(out, " %u\n", s->count);
+    }
+}
+
+static void write_flat(FILE* out)
+{
+    struct address* hist = malloc(PROFILE_STACKS * sizeof(*hist));
+    u32             n    = 0;
+
+    if (hist == NULL) {
+        return;
+    }
+
+    for (u32 i = 0; i < PROFILE_STACKS; i++) {
+        if (stacks[i].count != 0) {
+            hist[n++] = (struct address) { stacks[i].frames[0], stacks[i].count };
+        }
+    }
+
+    // several stacks may share the same innermost address
+    qsort(hist, n, sizeof(*hist), by_addr);
+
+    u32 m = 0;
+    for (u32 i = 0; i < n; i++) {
+        if (m > 0 && hist[m - 1].addr == hist[i].addr) {
+            hist[m - 1].count += hist[i].count;
+        } else {
+            hist[m++] = hist[i];
+        }
+    }
+
+    qsort(hist, m, sizeof(*hist), by_count);
+
+    fprintf(out, "%10s %7s  %s\n", "samples", "%", "address");
+    for (u32 i = 0; i < m; i++) {
+        fprintf(out, "%10u %6.2f%%  0x%08x\n", hist[i].count,
+            100.0 * hist[i].count / samples, hist[i].addr);
+    }
+
+    free(hist);
+}
+
+int profile_start(const char* path)
+{
+    if (path == NULL) {
+        return 0;
+    }
+
+    const char* env = getenv("CPU_PROFILE_HZ");
+    long        hz  = env ? strtol(env, NULL, 10) : PROFILE_HZ;
+
+    if (hz <= 0 || hz > 1000000) {
+        hz = PROFILE_HZ;
+    }
+
+    struct sigaction sa = { .sa_handler = sample, .sa_flags = SA_RESTART };
+    sigemptyset(&sa.sa_mask);
+
+    if (sigaction(SIGPROF, &sa, NULL) != 0) {
+        tracep();
+        return -1;
+    }
+
+    long           period = 1000000 / hz;
+    struct timeval tv     = { .tv_sec = period / 1000000, .tv_usec = period % 1000000 };
+    struct itimerval timer = { .it_interval = tv, .it_value = tv };
+
+    if (setitimer(ITIMER_PROF, &timer, NULL) != 0) {
+        tracep();
+        return -1;
+    }
+
+    output = path;
+    return 0;
+}
+
+void profile_block()
+{
+    sigset_t set;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGPROF);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+}
+
+void profile_stop()
+{
+    if (output == NULL) {
+        return;
+    }
+
+    struct itimerval off = { 0 };
+    setitimer(ITIMER_PROF, &off, NULL);
+    signal(SIGPROF, SIG_IGN);
+
+    FILE* out = fopen(output, "w");
+    if (out == NULL) {
+        perror(output);
+        return;
+    }
+    write_folded(out);
+    fclose(out);
+
+    char flat[FILENAME_MAX];
+    snprintf(flat, sizeof(flat), "%s.flat", output);
+
+    if ((out = fopen(flat, "w")) == NULL) {
+        perror(flat);
+        return;
+    }
+    write_flat(out);
+    fclose(out);
+
+    if (lost != 0) {
+        fprintf(stderr, "profile: %d of %d samples lost\n", (int)lost, (int)samples);
+    }
+
+    output = NULL;
+}
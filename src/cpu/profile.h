@@ -0,0 +1,42 @@
+#ifndef PROFILE_H_
+#define PROFILE_H_
+
+#include "mem.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//   Sampling profiler
+//
+//   CPU_PROFILE=<path> arms an ITIMER_PROF timer, CPU_PROFILE_HZ sets its
+//   rate (PROFILE_HZ by default). Each SIGPROF records the guest EIP and
+//   the return addresses found by following the %ebp chain, assuming the
+//   usual frame layout:
+//
+//       [%ebp + 4]  return address
+//       [%ebp]      caller's %ebp
+//
+//   The walk stops at a null or out of range %ebp, so frame-less code just
+//   yields the EIP. Samples go to a preallocated table from the signal
+//   handler, nothing is allocated or locked there. A stack probes at most
+//   PROFILE_PROBES slots of it, when they are all taken by other stacks
+//   the sample is counted as lost, so a full table costs no more than an
+//   empty one.
+//
+//   At exit <path> receives folded stacks, one "caller;...;callee count"
+//   line per distinct stack as flamegraph.pl expects, and <path>.flat a
+//   histogram of the sampled addresses, hottest first.
+//
+//   The timer signals whichever thread is running, helper threads call
+//   profile_block() first so the handler only ever runs on the guest's.
+//
+
+#define PROFILE_HZ 997
+#define PROFILE_DEPTH 32
+#define PROFILE_STACKS (1 << 14)
+#define PROFILE_PROBES 16
+
+int  profile_start(const char* path);
+void profile_stop();
+void profile_block();
+
+#endif /* PROFILE_H_ */
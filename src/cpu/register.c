@@ -105,3 +105,19 @@ char* r64_str(enum r64 reg)
         return "xmm7";
     }
 }
+
+char* operand_size_str(enum operand_size size)
+{
+    switch (size) {
+    case BYTE:
+        return "byte";
+    case WORD:
+        return "word";
+    case DWORD:
+        return "dword";
+    case QWORD:
+        return "qword";
+    }
+
+    return "?";
+}
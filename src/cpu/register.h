@@ -67,5 +67,6 @@ char* r8_str(enum r8 reg);
 char* r16_str(enum r16 reg);
 char* r32_str(enum r32 reg);
 char* r64_str(enum r64 reg);
+char* operand_size_str(enum operand_size size);
 
 #endif /* REGISTER_H_ */
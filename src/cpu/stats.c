@@ -0,0 +1,225 @@
+#include "stats.h"
+#include "opcode.h"
+#include "profile.h"
+#include "register.h"
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+struct stats stats;
+
+static enum stats_format format;
+static const char*       path;
+static pthread_t         watcher;
+
+#define read_counter(c) atomic_load_explicit(&(c), memory_order_relaxed)
+
+u64 stats_clock()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static u64 total_insns()
+{
+    u64 total = 0;
+
+    for (int op = 0; op < 256; op++) {
+        total += read_counter(stats.ops[op]);
+    }
+
+    return total;
+}
+
+static double mips(u64 insns, u64 ns)
+{
+    return ns == 0 ? 0.0 : (double)insns * 1e3 / ns;
+}
+
+// Instructions without an operand size are whatever the sized counters do
+// not account for
+static u64 unsized(int op)
+{
+    u64 count = read_counter(stats.ops[op]);
+
+    for (int size = BYTE; size <= QWORD; size++) {
+        count -= read_counter(stats.sized[op][size]);
+    }
+
+    return count;
+}
+
+static void export_json(FILE* out)
+{
+    u64  insns = total_insns();
+    u64  ns    = read_counter(stats.exec_ns);
+    bool first = true;
+
+    fprintf(out, "{\n");
+    fprintf(out, "  \"instructions\": %llu,\n", (unsigned long long)insns);
+    fprintf(out, "  \"exec_ns\": %llu,\n", (unsigned long long)ns);
+    fprintf(out, "  \"mips\": %.3f,\n", mips(insns, ns));
+    fprintf(out, "  \"memory_read_bytes\": %llu,\n",
+        (unsigned long long)read_counter(stats.mem_read));
+    fprintf(out, "  \"memory_written_bytes\": %llu,\n",
+        (unsigned long long)read_counter(stats.mem_written));
+    fprintf(out, "  \"stack_high_water_bytes\": %u,\n", read_counter(stats.stack_depth));
+    fprintf(out, "  \"opcodes\": [");
+
+    for (int op = 0; op < 256; op++) {
+        for (int size = BYTE; size <= QWORD + 1; size++) {
+            u64 count = size <= QWORD ? read_counter(stats.sized[op][size]) : unsized(op);
+
+            if (count == 0) {
+                continue;
+            }
+
+            fprintf(out, "%s\n    { \"opcode\": \"%s\", \"size\": ", first ? "" : ",",
+                opcode_str(op));
+            if (size <= QWORD) {
+                fprintf(out, "\"%s\"", operand_size_str(size));
+            } else {
+                fprintf(out, "null");
+            }
+            fprintf(out, ", \"count\": %llu }", (unsigned long long)count);
+            first = false;
+        }
+    }
+
+    fprintf(out, "\n  ]\n}\n");
+}
+
+static void export_prometheus(FILE* out)
+{
+    u64 insns = total_insns();
+    u64 ns    = read_counter(stats.exec_ns);
+
+    fprintf(out, "# HELP cpu_instructions_total Guest instructions executed.\n");
+    fprintf(out, "# TYPE cpu_instructions_total counter\n");
+
+    for (int op = 0; op < 256; op++) {
+        for (int size = BYTE; size <= QWORD + 1; size++) {
+            u64 count = size <= QWORD ? read_counter(stats.sized[op][size]) : unsized(op);
+
+            if (count != 0) {
+                fprintf(out, "cpu_instructions_total{opcode=\"%s\",size=\"%s\"} %llu\n",
+                    opcode_str(op), size <= QWORD ? operand_size_str(size) : "",
+                    (unsigned long long)count);
+            }
+        }
+    }
+
+    fprintf(out, "# HELP cpu_memory_read_bytes_total Guest memory bytes read.\n");
+    fprintf(out, "# TYPE cpu_memory_read_bytes_total counter\n");
+    fprintf(out, "cpu_memory_read_bytes_total %llu\n",
+        (unsigned long long)read_counter(stats.mem_read));
+
+    fprintf(out, "# HELP cpu_memory_written_bytes_total Guest memory bytes written.\n");
+    fprintf(out, "# TYPE cpu_memory_written_bytes_total counter\n");
+    fprintf(out, "cpu_memory_written_bytes_total %llu\n",
+        (unsigned long long)read_counter(stats.mem_written));
+
+    fprintf(out, "# HELP cpu_stack_high_water_bytes Deepest guest stack seen.\n");
+    fprintf(out, "# TYPE cpu_stack_high_water_bytes gauge\n");
+    fprintf(out, "cpu_stack_high_water_bytes %u\n", read_counter(stats.stack_depth));
+
+    fprintf(out, "# HELP cpu_exec_seconds_total Wall time spent in exec().\n");
+    fprintf(out, "# TYPE cpu_exec_seconds_total counter\n");
+    fprintf(out, "cpu_exec_seconds_total %.9f\n", ns / 1e9);
+
+    fprintf(out, "# HELP cpu_mips Guest instructions per microsecond of exec().\n");
+    fprintf(out, "# TYPE cpu_mips gauge\n");
+    fprintf(out, "cpu_mips %.3f\n", mips(insns, ns));
+}
+
+void stats_export(FILE* out, enum stats_format format)
+{
+    switch (format) {
+    case STATS_JSON:
+        export_json(out);
+        break;
+
+    case STATS_PROMETHEUS:
+        export_prometheus(out);
+        break;
+    }
+
+    fflush(out);
+}
+
+void stats_report()
+{
+    FILE* out = stderr;
+
+    if (path != NULL && (out = fopen(path, "w")) == NULL) {
+        perror(path);
+        return;
+    }
+
+    stats_export(out, format);
+
+    if (out != stderr) {
+        fclose(out);
+    }
+}
+
+static void* watch_signal(void* arg)
+{
+    sigset_t* set = arg;
+    int       sig;
+
+    profile_block();
+    while (sigwait(set, &sig) == 0) {
+        stats_report();
+    }
+
+    return NULL;
+}
+
+static void report_at_exit()
+{
+    stats_report();
+}
+
+// SIGUSR1 is blocked in the calling thread and, as long as this runs first,
+// in every thread started afterwards, so only the watcher ever receives it
+int stats_init()
+{
+    static sigset_t set;
+    const char*     env = getenv("CPU_STATS");
+
+    if (env == NULL) {
+        return 0;
+    }
+
+    if (strcmp(env, "json") == 0) {
+        format = STATS_JSON;
+    } else if (strcmp(env, "prometheus") == 0) {
+        format = STATS_PROMETHEUS;
+    } else {
+        fprintf(stderr, "stats: unknown format %s\n", env);
+        return -1;
+    }
+
+#ifndef CPU_STATS
+    fprintf(stderr, "stats: counters not built in, rebuild with STATS=1\n");
+#endif
+
+    path = getenv("CPU_STATS_FILE");
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    if (pthread_create(&watcher, NULL, watch_signal, &set) != 0) {
+        return -1;
+    }
+    pthread_detach(watcher);
+
+    atexit(report_at_exit);
+    return 0;
+}
@@ -0,0 +1,76 @@
+#ifndef STATS_H_
+#define STATS_H_
+
+#include "mem.h"
+#include <stdatomic.h>
+#include <stdio.h>
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//   Execution counters
+//
+//   Built in with `make STATS=1`, which defines CPU_STATS. Otherwise the
+//   stat_*() hooks compile to nothing and the counters stay at zero.
+//
+//   CPU_STATS=json|prometheus in the environment selects the export format,
+//   CPU_STATS_FILE the destination (stderr by default). A report is written
+//   when the program exits and whenever the process receives SIGUSR1.
+//
+//   Counters are only ever written by the executing thread. They are
+//   atomics so that a report taken while the guest runs is a clean, if
+//   not instantaneous, snapshot.
+//
+
+enum stats_format {
+    STATS_JSON,
+    STATS_PROMETHEUS,
+};
+
+struct stats {
+    _Atomic u64 ops[256];
+    _Atomic u64 sized[256][4];
+    _Atomic u64 mem_read;
+    _Atomic u64 mem_written;
+    _Atomic u32 stack_depth;
+    _Atomic u64 exec_ns;
+};
+
+extern struct stats stats;
+
+#define stat_add(counter, n)                                             \
+    atomic_store_explicit(&(counter),                                    \
+        atomic_load_explicit(&(counter), memory_order_relaxed) + (n),    \
+        memory_order_relaxed)
+
+#ifdef CPU_STATS
+#define stat_op(op) stat_add(stats.ops[op], 1)
+#define stat_size(op, size) stat_add(stats.sized[op][size], 1)
+#define stat_read(n) stat_add(stats.mem_read, n)
+#define stat_write(n) stat_add(stats.mem_written, n)
+#define stat_stack(depth) __stat_stack(depth)
+#define stat_exec_begin() u64 __exec_start = stats_clock()
+#define stat_exec_end() stat_add(stats.exec_ns, stats_clock() - __exec_start)
+#else
+#define stat_op(op) ((void)0)
+#define stat_size(op, size) ((void)0)
+#define stat_read(n) ((void)0)
+#define stat_write(n) ((void)0)
+#define stat_stack(depth) ((void)0)
+#define stat_exec_begin() ((void)0)
+#define stat_exec_end() ((void)0)
+#endif
+
+static inline void __stat_stack(u32 depth)
+{
+    if (depth > atomic_load_explicit(&stats.stack_depth, memory_order_relaxed)) {
+        atomic_store_explicit(&stats.stack_depth, depth, memory_order_relaxed);
+    }
+}
+
+u64 stats_clock();
+
+int  stats_init();
+void stats_export(FILE* out, enum stats_format format);
+void stats_report();
+
+#endif /* STATS_H_ */
@@ -1,39 +1,292 @@
 #include "cpu.h"
+#include "dump.h"
+#include "profile.h"
+#include "register.h"
+#include <pthread.h>
 #include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Single producer, single consumer: the owning thread moves head, the
+// drain thread moves tail
+struct trace_ring {
+    _Atomic u32         head;
+    _Atomic u32         tail;
+    _Atomic u64         dropped;
+    struct trace_ring*  next;
+    struct trace_record records[TRACE_RING_SIZE];
+};
+
+static _Thread_local struct trace_ring* ring;
+
+static _Atomic(struct trace_ring*) rings;
+static atomic_bool                 tracing;
+static atomic_bool                 draining;
+static pthread_t                   drainer;
+static FILE*                       file;
+
+static u64 now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static struct trace_ring* thread_ring()
+{
+    if (ring != NULL) {
+        return ring;
+    }
+
+    ring = calloc(1, sizeof(*ring));
+    if (ring == NULL) {
+        return NULL;
+    }
+
+    ring->next = atomic_load(&rings);
+    while (!atomic_compare_exchange_weak(&rings, &ring->next, ring))
+        ;
+
+    return ring;
+}
+
+// Reserves n consecutive records, or none at all when the ring is full
+static struct trace_record* reserve(u32 n, u32* head)
+{
+    struct trace_ring* r = thread_ring();
+
+    if (r == NULL) {
+        return NULL;
+    }
+
+    *head    = atomic_load_explicit(&r->head, memory_order_relaxed);
+    u32 tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+
+    if (TRACE_RING_SIZE - (*head - tail) < n) {
+        atomic_fetch_add_explicit(&r->dropped, n, memory_order_relaxed);
+        return NULL;
+    }
+
+    return r->records;
+}
+
+static void commit(u32 head)
+{
+    atomic_store_explicit(&ring->head, head, memory_order_release);
+}
+
+static void emit(enum trace_event event, u64 a0, u64 a1)
+{
+    u32                  head;
+    struct trace_record* records = reserve(1, &head);
+
+    if (records == NULL) {
+        return;
+    }
+
+    records[head % TRACE_RING_SIZE] = (struct trace_record) {
+        .time  = now(),
+        .event = event,
+        .eip   = cpu.gpr[EIP],
+        .args  = { a0, a1 },
+    };
+
+    commit(head + 1);
+}
+
+static void emit_message(enum trace_event event, const char* text, u16 len)
+{
+    u32                  head;
+    u32                  n       = 1;
+    struct trace_record* records = NULL;
+
+    if (len > sizeof(records->args)) {
+        n += (len - sizeof(records->args) + sizeof(*records) - 1)
+            / sizeof(*records);
+    }
+
+    if ((records = reserve(n, &head)) == NULL) {
+        return;
+    }
+
+    struct trace_record* record = &records[head % TRACE_RING_SIZE];
+    *record = (struct trace_record) {
+        .time  = now(),
+        .event = event,
+        .len   = len,
+        .eip   = cpu.gpr[EIP],
+    };
+
+    u16 chunk = len < sizeof(record->args) ? len : sizeof(record->args);
+    memcpy(record->args, text, chunk);
+
+    for (u32 i = 1; i < n; i++) {
+        text += chunk;
+        len -= chunk;
+        chunk  = len < sizeof(*record) ? len : sizeof(*record);
+        record = &records[(head + i) % TRACE_RING_SIZE];
+        memcpy(record, text, chunk);
+    }
+
+    commit(head + n);
+}
+
+static void vtrace(enum trace_event event, const char* func, const char* fmt,
+    va_list args)
+{
+    char buf[TRACE_MESSAGE_MAX];
+    int  len = 0;
+
+    if (func != NULL) {
+        len = snprintf(buf, sizeof(buf), "%s: ", func);
+    }
+
+    len += vsnprintf(buf + len, sizeof(buf) - len, fmt, args);
+    if (len >= (int)sizeof(buf)) {
+        len = sizeof(buf) - 1;
+    }
+
+    emit_message(event, buf, len);
+}
+
+static void drain()
+{
+    for (struct trace_ring* r = atomic_load(&rings); r != NULL; r = r->next) {
+        u32 tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        u32 head = atomic_load_explicit(&r->head, memory_order_acquire);
+
+        while (tail != head) {
+            u32 first = tail % TRACE_RING_SIZE;
+            u32 count = head - tail;
+
+            if (first + count > TRACE_RING_SIZE) {
+                count = TRACE_RING_SIZE - first;
+            }
+
+            fwrite(&r->records[first], sizeof(struct trace_record), count, file);
+            tail += count;
+        }
+
+        atomic_store_explicit(&r->tail, tail, memory_order_release);
+    }
+}
+
+static void* drain_loop(void* arg)
+{
+    (void)arg;
+    profile_block();
+
+    struct timespec idle = { .tv_nsec = 1000000 };
+
+    while (atomic_load(&draining)) {
+        drain();
+        nanosleep(&idle, NULL);
+    }
+
+    drain();
+    return NULL;
+}
+
+int trace_open(const char* path)
+{
+    if (path == NULL || atomic_load(&tracing)) {
+        return 0;
+    }
+
+    if ((file = fopen(path, "wb")) == NULL) {
+        perror(path);
+        return -1;
+    }
+
+    u64 hdr[2] = { TRACE_MAGIC, sizeof(struct trace_record) };
+    fwrite(hdr, sizeof(hdr), 1, file);
+
+    atomic_store(&draining, true);
+    if (pthread_create(&drainer, NULL, drain_loop, NULL) != 0) {
+        fclose(file);
+        return -1;
+    }
+
+    atomic_store(&tracing, true);
+    return 0;
+}
+
+void trace_close()
+{
+    if (!atomic_exchange(&tracing, false)) {
+        return;
+    }
+
+    atomic_store(&draining, false);
+    pthread_join(drainer, NULL);
+
+    for (struct trace_ring* r = atomic_load(&rings); r != NULL; r = r->next) {
+        u64 dropped = atomic_load(&r->dropped);
+        if (dropped != 0) {
+            fprintf(stderr, "trace: %llu records dropped\n", (unsigned long long)dropped);
+        }
+    }
+
+    fclose(file);
+}
 
 void __trace(const char* func, const char* message)
 {
-    printf("%s: %s\n", func, message);
+    if (atomic_load_explicit(&tracing, memory_order_relaxed)) {
+        __tracef(func, "%s", message);
+    }
 }
 
 void __tracef(const char* func, const char* fmt, ...)
 {
+    if (!atomic_load_explicit(&tracing, memory_order_relaxed)) {
+        return;
+    }
+
     va_list args;
     va_start(args, fmt);
-
-    printf("%s: ", func);
-    vprintf(fmt, args);
-    putchar('\n');
-
+    vtrace(EV_MESSAGE, func, fmt, args);
     va_end(args);
 }
 
+void __trace_event(enum trace_event event, u64 a0, u64 a1)
+{
+    if (atomic_load_explicit(&tracing, memory_order_relaxed)) {
+        emit(event, a0, a1);
+    }
+}
+
 void exception(const char* message)
 {
-    printf("(*) %s\n", message);
-    clean();
+    exceptionf("%s", message);
 }
 
 void exceptionf(const char* fmt, ...)
 {
+    char    reason[DUMP_REASON];
     va_list args;
-    va_start(args, fmt);
 
+#if TRACE_LEVEL >= TRACE_ERROR
+    if (atomic_load_explicit(&tracing, memory_order_relaxed)) {
+        va_start(args, fmt);
+        vtrace(EV_EXCEPTION, NULL, fmt, args);
+        va_end(args);
+    }
+
+    va_start(args, fmt);
     printf("(*) ");
     vprintf(fmt, args);
     putchar('\n');
+    va_end(args);
+#endif
 
+    va_start(args, fmt);
+    vsnprintf(reason, sizeof(reason), fmt, args);
     va_end(args);
+    dump_trap(reason);
+
     clean();
 }
@@ -0,0 +1,97 @@
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include "mem.h"
+#include <errno.h>
+#include <string.h>
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//   Tracing
+//
+//   Trace points are selected at compile time with TRACE_LEVEL, anything
+//   above the level compiles to nothing.
+//
+//   +-------------+---------------------------------------------+
+//   |    level    |                  trace points               |
+//   +-------------+---------------------------------------------+
+//   | TRACE_OFF   |                                             |
+//   | TRACE_ERROR | exception(), exceptionf()                   |
+//   | TRACE_INFO  | trace(), tracef(), tracep()                 |
+//   | TRACE_DEBUG | trace_event(), fired from the hot path      |
+//   +-------------+---------------------------------------------+
+//
+//   Enabled trace points append fixed size records to a lock-free ring
+//   owned by the calling thread. Once trace_open() is called, a background
+//   thread drains every ring into the trace file, which tracedump turns
+//   back into text. Records are dropped, never waited on, when a ring is
+//   full.
+//
+//   A message takes one EV_MESSAGE record whose `len` is the length of
+//   the text, the first 16 bytes of which are stored in `args`. The rest
+//   of the text follows in raw 32 byte records.
+//
+
+#define TRACE_OFF 0
+#define TRACE_ERROR 1
+#define TRACE_INFO 2
+#define TRACE_DEBUG 3
+
+#ifndef TRACE_LEVEL
+#define TRACE_LEVEL TRACE_INFO
+#endif
+
+#define TRACE_MAGIC 0x3130656361727424
+#define TRACE_RING_SIZE (1 << 12)
+#define TRACE_MESSAGE_MAX 256
+
+enum trace_event {
+    EV_MESSAGE,
+    EV_EXCEPTION,
+    EV_EXEC,
+    EV_HALT,
+    EV_INSN,
+    EV_INTERRUPT,
+    EV_HEAP_ALLOC,
+    EV_HEAP_FREE,
+    EV_TRAP,
+    EV_WATCH,
+};
+
+struct trace_record {
+    u64 time; // nanoseconds, monotonic clock
+    u16 event;
+    u16 len;
+    u32 eip;
+    u64 args[2];
+};
+
+#if TRACE_LEVEL >= TRACE_INFO
+#define trace(message) __trace(__func__, message)
+#define tracef(fmt, ...) __tracef(__func__, fmt, __VA_ARGS__)
+#define tracep() __trace(__func__, strerror(errno))
+#else
+#define trace(message) ((void)0)
+#define tracef(fmt, ...) ((void)0)
+#define tracep() ((void)0)
+#endif
+
+#if TRACE_LEVEL >= TRACE_DEBUG
+#define trace_event(event, a0, a1) __trace_event(event, a0, a1)
+#else
+#define trace_event(event, a0, a1) ((void)0)
+#endif
+
+void __trace(const char* func, const char* message);
+void __tracef(const char* func, const char* fmt, ...);
+void __trace_event(enum trace_event event, u64 a0, u64 a1);
+
+void exception(const char* message);
+void exceptionf(const char* fmt, ...);
+
+int  trace_open(const char* path);
+void trace_close();
+
+char* trace_event_str(enum trace_event event);
+
+#endif /* TRACE_H_ */
@@ -0,0 +1,148 @@
+#include "verify.h"
+#include "cpu.h"
+#include "insn.h"
+#include "register.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// one bit per text byte, set where an instruction starts
+static const u64* starts;
+static u64*       owned;
+
+// v2 words must leave the size bits of unsized layouts and every
+// register field past the last one clear
+static bool reserved_clear(const u8* code, const struct insn* insn)
+{
+    enum layout layout = opcodes[insn->op].layout;
+    u32         word;
+
+    memcpy(&word, code, sizeof(word));
+
+    if (!layout_sized(layout) && (word & 0x03) != 0) {
+        return false;
+    }
+
+    int shift = V2_REG_SHIFT(insn_regs(layout));
+    return shift >= 32 || word >> shift == 0;
+}
+
+static int reject(struct verify_error* err, u32 offset, const char* fmt, ...)
+{
+    va_list args;
+
+    va_start(args, fmt);
+    err->offset = offset;
+    vsnprintf(err->reason, sizeof(err->reason), fmt, args);
+    va_end(args);
+
+    tracef("verify: 0x%08x: %s", offset, err->reason);
+    return -1;
+}
+
+// Checks the text instruction by instruction, marking their starts in map
+static int walk(u32 len, u64* map, struct verify_error* err)
+{
+    enum isa isa = cpu.isa;
+    u32      pc  = 0;
+
+    for (;;) {
+        struct insn insn;
+        const u8*   code = cpu.data + pc;
+
+        if (pc == len) {
+            return reject(err, pc, "no halt before the end of text");
+        }
+
+        if (decode_insn(isa, code, len - pc, &insn) < 0) {
+            u8 op = isa == ISA_V2 ? V2_OP(code[0] | code[1] << 8) : code[0];
+
+            if (isa == ISA_V2 && len - pc < V2_WORD) {
+                return reject(err, pc, "partial word at the end of text");
+            } else if (opcodes[op].name == NULL) {
+                return reject(err, pc, "unassigned opcode 0x%02x", op);
+            }
+            return reject(err, pc, "%s runs past the end of text", opcodes[op].mnemonic);
+        }
+
+        for (int n = 0; n < insn_regs(opcodes[insn.op].layout); n++) {
+            enum operand_size size = insn_reg_size(&insn, n);
+
+            if (reg_name(size, insn.reg[n]) == NULL) {
+                return reject(err, pc, "%s operand %d is not a %s register (%d)",
+                    opcodes[insn.op].mnemonic, n + 1, operand_size_str(size), insn.reg[n]);
+            }
+        }
+
+        if (insn.op == BRK) {
+            return reject(err, pc, "brk is reserved for the debugger");
+        }
+
+        if (isa == ISA_V2 && !reserved_clear(code, &insn)) {
+            return reject(err, pc, "%s has reserved bits set", opcodes[insn.op].mnemonic);
+        }
+
+        map[pc / 64] |= 1ull << pc % 64;
+
+        if (insn.op == HALT) {
+            break;
+        }
+
+        pc += insn.len;
+    }
+
+    return 0;
+}
+
+int verify(u32 len, struct verify_error* err)
+{
+    u64* map = calloc(VERIFY_MAP_WORDS(len), sizeof(u64));
+
+    cpu.text_len = 0;
+
+    if (map == NULL) {
+        return reject(err, 0, "out of memory");
+    }
+
+    if (walk(len, map, err) != 0) {
+        free(map);
+        return -1;
+    }
+
+    free(owned);
+    starts = owned = map;
+    cpu.text_len   = len;
+    seal_text(true);
+    return 0;
+}
+
+void verify_adopt(u32 len, const u64* map)
+{
+    free(owned);
+    owned        = NULL;
+    starts       = map;
+    cpu.text_len = len;
+    seal_text(true);
+}
+
+const u64* verify_map()
+{
+    return starts;
+}
+
+void seal_text(bool sealed)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t len  = ((size_t)cpu.text_len + page - 1) / page * page;
+
+    if (len != 0) {
+        mprotect(cpu.data, len, sealed ? PROT_READ : PROT_READ | PROT_WRITE);
+    }
+}
+
+bool insn_start(u32 addr)
+{
+    return addr < cpu.text_len && (starts[addr / 64] >> addr % 64 & 1);
+}
@@ -0,0 +1,62 @@
+#ifndef VERIFY_H_
+#define VERIFY_H_
+
+#include "mem.h"
+#include <stdbool.h>
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//   Verifier
+//
+//   exec() trusts the text it runs: handlers index the register files
+//   straight from the operand fields and nothing checks for running off
+//   the end of the text. verify() earns that trust once per image, walking
+//   the text in cpu.isa from address 0 to the first HALT and rejecting
+//
+//     - unassigned opcodes, and BRK which belongs to the debugger
+//     - instructions running past the end of the text
+//     - register indices that are not registers of the operand's size
+//     - v2 words with reserved bits set
+//     - text without a HALT
+//
+//   Writing %eip or %ip is the one way to branch, and the only transfer
+//   exec() checks as it goes: a target that is no instruction start of
+//   the verified text traps with TRAP_JUMP, so bytes past the first HALT,
+//   in data or inside an instruction never run.
+//
+//   Verified text is sealed: its host pages are made read-only, so a
+//   guest store into them faults the host instead of rewriting operands
+//   exec() no longer checks. Images keep their data on later pages for
+//   that, see IMAGE_DATA_ALIGN.
+//
+//   Verification leaves a map of the instruction starts behind, which the
+//   debugger and the watchpoints use to find their way in the text and the
+//   code cache (cache.h) keeps for the next run of the same text.
+//
+
+struct verify_error {
+    u32  offset;     // of the offending instruction
+    char reason[64];
+};
+
+#define VERIFY_MAP_WORDS(len) (((len) + 63) / 64)
+
+// Verifies cpu.data[0, len) and sets cpu.text_len, -1 with err filled in
+// if the text is rejected
+int verify(u32 len, struct verify_error* err);
+
+// Takes the map of text verified in an earlier run, VERIFY_MAP_WORDS(len)
+// words the caller keeps alive
+void       verify_adopt(u32 len, const u64* map);
+const u64* verify_map();
+
+// Makes the pages of the verified text read-only, or writable again for
+// the debugger to patch or the caller to put new text in place. verify()
+// and verify_adopt() seal it.
+void seal_text(bool sealed);
+
+// Whether an instruction of the verified text starts at addr, HALT being
+// the last one
+bool insn_start(u32 addr);
+
+#endif /* VERIFY_H_ */
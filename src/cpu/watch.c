@@ -0,0 +1,329 @@
+#include "watch.h"
+#include "cpu.h"
+#include "insn.h"
+#include "register.h"
+#include "verify.h"
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+struct watch {
+    u32  addr;
+    u32  len;
+    bool read;
+    u64  old; // value before the access being stepped over
+};
+
+static struct watch watches[WATCH_MAX];
+static int          watches_len;
+
+static u32  page_size;
+static bool armed;
+static bool stepping;
+static u32  fault_addr;
+static u32  fault_eip;
+static u32  fault_len;
+static bool fault_store;
+
+static struct sigaction previous;
+
+static u32 round_up(u32 addr)
+{
+    return (addr + page_size - 1) / page_size * page_size;
+}
+
+static void protect(u32 addr, u32 len, int prot)
+{
+    u32 start = addr / page_size * page_size;
+    mprotect(cpu.data + start, round_up(addr + len) - start, prot);
+}
+
+// Read watches go last, a page holding both kinds must not be readable
+static void protect_watches(bool on)
+{
+    for (int i = 0; i < watches_len; i++) {
+        if (!watches[i].read) {
+            protect(watches[i].addr, watches[i].len, on ? PROT_READ : PROT_READ | PROT_WRITE);
+        }
+    }
+
+    for (int i = 0; i < watches_len; i++) {
+        if (watches[i].read) {
+            protect(watches[i].addr, watches[i].len, on ? PROT_NONE : PROT_READ | PROT_WRITE);
+        }
+    }
+}
+
+static bool watched_page(u32 addr)
+{
+    for (int i = 0; i < watches_len; i++) {
+        u32 start = watches[i].addr / page_size * page_size;
+        if (addr >= start && addr < round_up(watches[i].addr + watches[i].len)) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static u64 value(const struct watch* w)
+{
+    u64 val = 0;
+    memcpy(&val, &cpu.data[w->addr], w->len); // little-endian host
+    return val;
+}
+
+// Start of the instruction before the one holding addr
+static u32 insn_before(u32 addr)
+{
+    while (addr > 0 && !insn_start(addr)) {
+        addr--;
+    }
+    while (addr > 0 && !insn_start(--addr)) {
+    }
+
+    return addr;
+}
+
+// Decodes the instruction that faulted for what it does to memory: mov
+// and push store, loads and cmp read. An int is up to the service it
+// calls, it may touch anything and is only seen to write by what it
+// changes.
+static void classify(u32 eip)
+{
+    struct insn insn;
+
+    fault_store = false;
+    fault_len   = sizeof(u64);
+
+    if (decode_insn(cpu.isa, &cpu.data[eip], cpu.text_len - eip, &insn) < 0) {
+        return;
+    }
+
+    switch (insn.op) {
+    case MOV_MI:
+    case MOV_MR:
+        fault_store = true;
+        fault_len   = 1 << insn.size;
+        break;
+    case PUSH:
+        fault_store = true;
+        fault_len   = insn.size == QWORD ? sizeof(u64) : sizeof(u32);
+        break;
+    case POP:
+        fault_len = insn.size == QWORD ? sizeof(u64) : sizeof(u32);
+        break;
+    case MOV_RM:
+    case CMP_RM:
+    case CMP_MI:
+    case CMP_MR:
+        fault_len = 1 << insn.size;
+        break;
+    default:
+        break;
+    }
+}
+
+// The access at fault_addr fell on w
+static bool touched(const struct watch* w)
+{
+    return fault_addr + fault_len > w->addr && fault_addr < w->addr + w->len;
+}
+
+// Reports are formatted by hand and written with write(2), they are made
+// from the signal handler
+static char* put_str(char* p, const char* s)
+{
+    while (*s != '\0') {
+        *p++ = *s++;
+    }
+    return p;
+}
+
+static char* put_hex(char* p, u64 val, int digits)
+{
+    char tmp[16];
+    int  n = 0;
+
+    do {
+        tmp[n++] = "0123456789abcdef"[val & 0xf];
+        val >>= 4;
+    } while (val != 0 || n < digits);
+
+    p = put_str(p, "0x");
+    while (n > 0) {
+        *p++ = tmp[--n];
+    }
+    return p;
+}
+
+static void report_one(const struct watch* w, const char* what, u64 now)
+{
+    char  line[128];
+    char* p = line;
+
+    p    = put_hex(put_str(p, "watch "), w->addr, 8);
+    *p++ = '+';
+    *p++ = '0' + w->len;
+    p    = put_str(put_hex(put_str(p, ": eip "), fault_eip, 8), what);
+    if (now != w->old) {
+        p = put_str(put_hex(p, w->old, 1), " -> ");
+    }
+    p    = put_hex(p, now, 1);
+    *p++ = '\n';
+
+    write(STDERR_FILENO, line, p - line);
+    trace_event(EV_WATCH, w->addr, now);
+}
+
+static void report()
+{
+    for (int i = 0; i < watches_len; i++) {
+        struct watch* w   = &watches[i];
+        u64           now = value(w);
+
+        // a store of the value already there is a write all the same
+        if (now != w->old || (fault_store && touched(w))) {
+            report_one(w, " wrote ", now);
+        } else if (w->read && touched(w)) {
+            report_one(w, " read ", now);
+        }
+    }
+}
+
+static void on_fault(int sig, siginfo_t* info, void* context)
+{
+    (void)sig;
+    (void)context;
+
+    u8* host = info->si_addr;
+    u32 addr = host - cpu.data;
+
+    if (!armed || host < cpu.data || host >= cpu.data + MEMORY_SIZE) {
+        // not ours, fault again the way it would have without watches
+        sigaction(SIGSEGV, &previous, NULL);
+        return;
+    }
+
+    // The step ends at the fetch of the next instruction, at %eip. Any other
+    // access to the text pages comes from the stepped instruction itself,
+    // after its watched access: it ends the step as well and proceeds once
+    // they are readable again. The report names fault_eip either way.
+    if (stepping && addr < round_up(cpu.text_len)) {
+        protect(0, cpu.text_len, PROT_READ); // sealed, see verify.h
+        report();
+        protect_watches(true);
+        stepping = false;
+        return;
+    }
+
+    if (stepping || !watched_page(addr)) {
+        sigaction(SIGSEGV, &previous, NULL);
+        return;
+    }
+
+    protect_watches(false);
+    for (int i = 0; i < watches_len; i++) {
+        watches[i].old = value(&watches[i]);
+    }
+
+    // handlers fetch their operands first, %eip is already past the
+    // instruction making the access. It is decoded while the text is
+    // still readable.
+    stepping   = true;
+    fault_addr = addr;
+    fault_eip  = insn_before(cpu.gpr[EIP]);
+    classify(fault_eip);
+    protect(0, cpu.text_len, PROT_NONE);
+}
+
+static int parse(const char* spec)
+{
+    const char* p = spec;
+
+    while (*p != '\0') {
+        struct watch w = { .len = sizeof(u32) };
+        char*        end;
+
+        w.addr = strtoul(p, &end, 0);
+        if (*end == '+') {
+            w.len = strtoul(end + 1, &end, 0);
+        }
+        if (*end == ':' && end[1] == 'r') {
+            w.read = true;
+            end += 2;
+        }
+
+        if (end == p || (*end != ',' && *end != '\0') || w.len == 0 || w.len > sizeof(u64)
+            || w.addr >= MEMORY_SIZE - w.len || watches_len == WATCH_MAX) {
+            fprintf(stderr, "watch: bad watchpoint %s\n", p);
+            return -1;
+        }
+
+        if (w.addr / page_size * page_size < round_up(cpu.text_len)) {
+            fprintf(stderr, "watch: 0x%08x shares a page with text\n", w.addr);
+            return -1;
+        }
+
+        watches[watches_len++] = w;
+        p                      = *end == ',' ? end + 1 : end;
+    }
+
+    return 0;
+}
+
+int watch_start(const char* spec)
+{
+    if (spec == NULL) {
+        return 0;
+    }
+
+    page_size = sysconf(_SC_PAGESIZE);
+
+    if (parse(spec) != 0) {
+        watches_len = 0;
+        return -1;
+    }
+
+    struct sigaction sa = { .sa_sigaction = on_fault, .sa_flags = SA_SIGINFO };
+    sigemptyset(&sa.sa_mask);
+
+    if (sigaction(SIGSEGV, &sa, &previous) != 0) {
+        tracep();
+        watches_len = 0;
+        return -1;
+    }
+
+    watch_arm();
+    return 0;
+}
+
+void watch_stop()
+{
+    if (watches_len == 0) {
+        return;
+    }
+
+    watch_disarm();
+    sigaction(SIGSEGV, &previous, NULL);
+    watches_len = 0;
+}
+
+void watch_disarm()
+{
+    if (armed) {
+        protect_watches(false);
+        armed = false;
+    }
+}
+
+void watch_arm()
+{
+    if (!armed && watches_len > 0) {
+        protect_watches(true);
+        armed = true;
+    }
+}
@@ -0,0 +1,37 @@
+#ifndef WATCH_H_
+#define WATCH_H_
+
+#include "mem.h"
+
+////////////////////////////////////////////////////////////////////////////////
+//
+//   Watchpoints
+//
+//   CPU_WATCH=<addr>[+<len>][:r],... watches guest bytes for writes, or
+//   with :r for reads as well. len is 1 to 8 bytes, 4 by default.
+//
+//   The host pages behind watched bytes are mprotect-ed, everything else
+//   runs at full speed. A fault on them lets the access through by lifting
+//   the protection and revoking access to the text instead, so fetching
+//   the next instruction faults right after it. That second fault puts
+//   both back and reports the access to stderr if it wrote watched bytes,
+//   or for :r watches if it read them. Whether it is a write comes from
+//   decoding the instruction, a store of the value already there counts:
+//
+//       watch 0x00100000+4: eip 0x00000012 wrote 0x5 -> 0x9
+//
+//   eip is the instruction that made the access, for the guest heap
+//   services the int that called them. Watched pages may not hold text.
+//
+
+#define WATCH_MAX 16
+
+// Arms the watchpoints listed in spec if set, -1 if it does not parse
+int  watch_start(const char* spec);
+void watch_stop();
+
+// Lifts the protection while the debugger has the guest stopped
+void watch_disarm();
+void watch_arm();
+
+#endif /* WATCH_H_ */
@@ -0,0 +1,149 @@
+#include "../cpu/dump.h"
+#include "../cpu/insn.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static FILE*              file;
+static struct dump_header hdr;
+static u32*               page_index;
+
+// Reads guest memory back out of the dump, pages not in it are zeros
+static void read_mem(u32 addr, u8* buf, u32 len)
+{
+    memset(buf, 0, len);
+
+    for (u32 i = 0; i < hdr.pages; i++) {
+        u64 start = (u64)page_index[i] * DUMP_PAGE;
+        u64 end   = start + DUMP_PAGE;
+
+        if (end <= addr || start >= (u64)addr + len) {
+            continue;
+        }
+
+        u64  from = start > addr ? start : addr;
+        u64  to   = end < (u64)addr + len ? end : (u64)addr + len;
+        long pos  = sizeof(hdr) + hdr.pages * sizeof(u32) + i * DUMP_PAGE + (from - start);
+
+        if (fseek(file, pos, SEEK_SET) != 0
+            || fread(buf + (from - addr), 1, to - from, file) != to - from) {
+            memset(buf + (from - addr), 0, to - from);
+        }
+    }
+}
+
+static void print_ranges()
+{
+    printf("pages %llu\n", (unsigned long long)hdr.pages);
+
+    for (u32 i = 0; i < hdr.pages;) {
+        u32 first = i;
+
+        while (i + 1 < hdr.pages && page_index[i + 1] == page_index[i] + 1) {
+            i++;
+        }
+
+        printf("  %08x-%08x\n", page_index[first] * DUMP_PAGE, (page_index[i] + 1) * DUMP_PAGE);
+        i++;
+    }
+}
+
+static void print_eip()
+{
+    u32         eip = hdr.gpr[EIP];
+    u8          code[INSN_MAX];
+    struct insn insn;
+    char        line[80] = "(does not decode)";
+
+    read_mem(eip, code, sizeof(code));
+    if (eip < hdr.text_len && decode_insn(hdr.isa, code, hdr.text_len - eip, &insn) > 0) {
+        format_insn(line, sizeof(line), &insn);
+    }
+
+    printf("at   %08x  %s\n", eip, line);
+}
+
+static void hexdump(u32 addr, u32 len)
+{
+    u8 row[16];
+
+    for (u32 off = 0; off < len; off += sizeof(row)) {
+        u32 n = len - off < sizeof(row) ? len - off : sizeof(row);
+
+        read_mem(addr + off, row, n);
+        printf("%08x ", addr + off);
+        for (u32 i = 0; i < n; i++) {
+            printf(" %02x", row[i]);
+        }
+        putchar('\n');
+    }
+}
+
+int main(int argc, char** argv)
+{
+    u32  addr = 0, len = 0;
+    bool examine = argc == 4 && strcmp(argv[1], "-x") == 0;
+
+    if (argc != 2 && !examine) {
+        fprintf(stderr, "usage: %s [-x addr[+len]] dump\n", argv[0]);
+        return 1;
+    }
+
+    if (examine) {
+        char* end;
+
+        addr = strtoul(argv[2], &end, 0);
+        len  = *end == '+' ? strtoul(end + 1, &end, 0) : 64;
+        if (*end != '\0' || len == 0) {
+            fprintf(stderr, "%s: bad range %s\n", argv[0], argv[2]);
+            return 1;
+        }
+    }
+
+    const char* path = argv[argc - 1];
+
+    if ((file = fopen(path, "rb")) == NULL) {
+        perror(path);
+        return 1;
+    }
+
+    if (fread(&hdr, sizeof(hdr), 1, file) != 1 || hdr.magic != DUMP_MAGIC
+        || hdr.version != DUMP_VERSION || hdr.pages > (1ull << 32) / DUMP_PAGE
+        || (hdr.isa != ISA_V1 && hdr.isa != ISA_V2)
+        || (page_index = malloc(hdr.pages * sizeof(u32) + 1)) == NULL
+        || fread(page_index, sizeof(u32), hdr.pages, file) != hdr.pages) {
+        fprintf(stderr, "%s: not a dump\n", path);
+        fclose(file);
+        free(page_index);
+        return 1;
+    }
+
+    if (examine) {
+        hexdump(addr, len);
+    } else {
+        hdr.reason[DUMP_REASON - 1] = '\0';
+        printf("%s\n", hdr.reason);
+        if (hdr.signal != 0) {
+            printf("signal %d\n", hdr.signal);
+        }
+        printf("isa v%u, text 0x%x bytes\n", hdr.isa == ISA_V2 ? 2 : 1, hdr.text_len);
+        if (hdr.trap_handler != 0) {
+            printf("trap handler %08x\n", hdr.trap_handler);
+        }
+        print_eip();
+
+        for (int i = 0; i < 16; i++) {
+            printf("%4s 0x%08x\n", r32_str(i), hdr.gpr[i]);
+        }
+        for (int i = 0; i < 8; i++) {
+            printf("xmm%d 0x%016llx\n", i, (unsigned long long)hdr.xmm[i]);
+        }
+        printf("flags 0x%08x\n", hdr.flags);
+
+        print_ranges();
+    }
+
+    fclose(file);
+    free(page_index);
+    return 0;
+}
@@ -0,0 +1,87 @@
+#include "../cpu/image.h"
+#include "../cpu/insn.h"
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Prints the text section of an image, one instruction per line. Code
+// that does not decode is shown as .byte, or .long in v2, and skipped
+// one byte or word at a time.
+static void disassemble(enum isa isa, const u8* text, u32 len)
+{
+    char line[80];
+
+    for (u32 pc = 0; pc < len;) {
+        struct insn insn;
+        int         n = decode_insn(isa, text + pc, len - pc, &insn);
+
+        if (n < 0 && isa == ISA_V2 && len - pc >= V2_WORD) {
+            u32 word;
+            memcpy(&word, text + pc, sizeof(word));
+            snprintf(line, sizeof(line), ".long 0x%08x", word);
+            n = V2_WORD;
+        } else if (n < 0) {
+            snprintf(line, sizeof(line), ".byte 0x%02x", text[pc]);
+            n = 1;
+        } else {
+            format_insn(line, sizeof(line), &insn);
+        }
+
+        printf("%08x  ", pc);
+        for (int i = 0; i < INSN_MAX; i++) {
+            if (i < n) {
+                printf("%02x ", text[pc + i]);
+            } else {
+                printf("   ");
+            }
+        }
+        printf(" %s\n", line);
+
+        pc += n;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s image\n", argv[0]);
+        return 1;
+    }
+
+    FILE* file = fopen(argv[1], "rb");
+
+    if (file == NULL) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    struct image_header hdr  = { .isa = ISA_V1 };
+    u8*                 text = NULL;
+
+    // the isa field is not there in HDR_MAGIC images
+    bool ok = fread(&hdr, offsetof(struct image_header, isa), 1, file) == 1
+        && (hdr.magic == HDR_MAGIC
+            || ((hdr.magic == HDR_MAGIC_ISA || hdr.magic == HDR_MAGIC_PAGED)
+                && fread(&hdr.isa, sizeof(hdr.isa), 1, file) == 1))
+        && (hdr.magic != HDR_MAGIC_PAGED || fseek(file, IMAGE_TEXT_OFFSET, SEEK_SET) == 0);
+
+    if (!ok || hdr.text_len > hdr.total_len || (hdr.isa != ISA_V1 && hdr.isa != ISA_V2)) {
+        fprintf(stderr, "%s: not an image\n", argv[1]);
+    } else if ((text = malloc(hdr.text_len)) == NULL
+        || fread(text, 1, hdr.text_len, file) != hdr.text_len) {
+        fprintf(stderr, "%s: truncated image\n", argv[1]);
+        free(text);
+        text = NULL;
+    }
+
+    fclose(file);
+
+    if (text == NULL) {
+        return 1;
+    }
+
+    disassemble(hdr.isa, text, hdr.text_len);
+    free(text);
+    return 0;
+}
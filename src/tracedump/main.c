@@ -0,0 +1,89 @@
+#include "../cpu/trace.h"
+#include <stdbool.h>
+#include <stdio.h>
+
+static FILE* file;
+
+static int read_record(struct trace_record* record)
+{
+    return fread(record, sizeof(*record), 1, file) == 1;
+}
+
+// False for a message longer than the trace ever writes, the file is
+// not to be trusted past it
+static bool print_message(struct trace_record* record)
+{
+    char text[TRACE_MESSAGE_MAX + sizeof(*record)];
+    u16  len   = record->len;
+    u16  chunk = len < sizeof(record->args) ? len : sizeof(record->args);
+    u16  done  = chunk;
+
+    if (len > TRACE_MESSAGE_MAX) {
+        return false;
+    }
+
+    memcpy(text, record->args, chunk);
+
+    while (done < len && read_record((struct trace_record*)&text[done])) {
+        done += sizeof(*record);
+    }
+
+    text[len < done ? len : done] = '\0';
+    printf("%s", text);
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s trace-file\n", argv[0]);
+        return 1;
+    }
+
+    if ((file = fopen(argv[1], "rb")) == NULL) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    u64 hdr[2];
+    if (fread(hdr, sizeof(hdr), 1, file) != 1 || hdr[0] != TRACE_MAGIC
+        || hdr[1] != sizeof(struct trace_record)) {
+        fprintf(stderr, "%s: not a trace file\n", argv[1]);
+        fclose(file);
+        return 1;
+    }
+
+    struct trace_record record;
+    u64                 start = 0;
+
+    while (read_record(&record)) {
+        if (start == 0) {
+            start = record.time;
+        }
+
+        printf("%12.3f us  %08x  %-10s ", (record.time - start) / 1e3,
+            record.eip, trace_event_str(record.event));
+
+        switch (record.event) {
+        case EV_MESSAGE:
+        case EV_EXCEPTION:
+            if (!print_message(&record)) {
+                putchar('\n');
+                fprintf(stderr, "%s: malformed record\n", argv[1]);
+                fclose(file);
+                return 1;
+            }
+            break;
+
+        default:
+            printf("0x%llx 0x%llx", (unsigned long long)record.args[0],
+                (unsigned long long)record.args[1]);
+            break;
+        }
+
+        putchar('\n');
+    }
+
+    fclose(file);
+    return 0;
+}
@@ -0,0 +1,9 @@
+; Branching into data traps, the bytes there were never verified
+; expect: jump: 0x00004000 is not an instruction
+
+    mov %eip, payload
+    halt
+
+.data
+payload:
+    .byte 0x91
@@ -0,0 +1,5 @@
+; Writing %ip branches within the current 64K and is checked the same way
+; expect: jump: 0x00000003 is not an instruction
+
+    mov %ip, 3
+    halt
@@ -0,0 +1,5 @@
+; Branching into the operands of an instruction traps as well
+; expect: jump: 0x00000001 is not an instruction
+
+    mov %eip, 1
+    halt
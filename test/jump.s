@@ -0,0 +1,14 @@
+; A branch to an instruction runs it, a bad one goes to the guest trap
+; handler
+; expect: ecx 0x00000007
+
+    mov %eax, handler
+    int 0x22
+    mov %eip, over
+    mov %eip, 0x4000
+over:
+    mov %ebx, 7
+    mov %eip, 0x4000
+handler:
+    mov %ecx, %ebx
+    halt
@@ -0,0 +1,26 @@
+#!/bin/sh
+#
+# Assembles every test/*.s in both encodings, runs it and looks for the
+# line given by its `; expect:` comment in what the cpu prints
+#
+
+img=$(mktemp)
+trap 'rm -f "$img"' EXIT
+status=0
+
+for src in test/*.s; do
+    expect=$(sed -n 's/^; expect: //p' "$src")
+
+    for isa in v1 v2; do
+        flag=$([ $isa = v2 ] && echo -2)
+
+        if ./asm $flag -o "$img" "$src" && ./cpu "$img" 2>&1 | grep -qF "$expect"; then
+            echo "ok   $src ($isa)"
+        else
+            echo "FAIL $src ($isa): expected \"$expect\""
+            status=1
+        fi
+    done
+done
+
+exit $status